@@ -0,0 +1,8 @@
+# frozen_string_literal: true
+
+require "mkmf"
+
+# The resolution code is compiled straight from rubyexec.c in the top directory.
+$INCFLAGS << " -I$(srcdir)/../.."
+$defs << "-DRUBYEXEC_LIBRARY"
+create_makefile("rubyexec/rubyexec")
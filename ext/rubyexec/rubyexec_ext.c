@@ -0,0 +1,69 @@
+/*
+ * Copyright © 2024 konsolebox
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the “Software”), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* rubyexec.c defines _GNU_SOURCE, so it has to come before ruby.h. */
+#include "rubyexec.c"
+
+#include <ruby.h>
+
+/*
+ * RubyExec.resolve(spec, dir) -> [impl_path, impl_name] or nil
+ *
+ * Resolves spec the way rubyexec installed in dir would.  Returns nil
+ * whenever only rubyexec itself can launch the script correctly: an invalid
+ * spec, options other than --autopick, options from its configuration files
+ * or a snapshot, or an interpreter it would have to probe.
+ */
+static VALUE rubyexec_resolve(VALUE self, VALUE spec_str, VALUE dir)
+{
+	char buf[RUBYEXEC_PATH_SIZE], impl_path[RUBYEXEC_PATH_SIZE];
+	rubyexec_spec_t spec;
+	rubyexec_default_t def;
+	const char *impl_name;
+	(void) self;
+
+	if (rubyexec_parse_spec(StringValueCStr(spec_str), buf, sizeof(buf), &spec) != RUBYEXEC_OK)
+		return Qnil;
+
+	for (const char *const *option = spec.options; *option != NULL; ++option)
+		if (strcmp(*option, "-a") != 0 && strcmp(*option, "--autopick") != 0)
+			return Qnil;
+
+	if (rubyexec_has_launcher_settings(StringValueCStr(dir)))
+		return Qnil;
+
+	if (rubyexec_read_default(StringValueCStr(dir), &def) != RUBYEXEC_OK || def.name == NULL)
+		return Qnil;
+
+	if (rubyexec_select(&spec, StringValueCStr(dir), &def, NULL, impl_path, sizeof(impl_path),
+			&impl_name) != RUBYEXEC_OK)
+		return Qnil;
+
+	return rb_ary_new_from_args(2, rb_str_new_cstr(impl_path), rb_str_new_cstr(impl_name));
+}
+
+void Init_rubyexec(void)
+{
+	VALUE module = rb_define_module("RubyExec");
+	rb_define_module_function(module, "resolve", rubyexec_resolve, 2);
+}
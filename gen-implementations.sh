@@ -0,0 +1,120 @@
+#!/bin/sh
+
+# Generates implementations.h from implementations.list: the table of
+# implementation names and classes indexed by ID, and a collision-free hash
+# table from names to IDs.  The hash must match find_implementation() in
+# rubyexec.c.
+#
+# Usage: gen-implementations.sh [list [header]]
+
+set -e
+
+list=${1:-$(dirname "$0")/implementations.list}
+header=${2:-$(dirname "$0")/implementations.h}
+
+awk '
+function hash(str, seed,    h, i) {
+	h = seed
+	for (i = 1; i <= length(str); ++i)
+		h = (h * 33 + ord[substr(str, i, 1)]) % 1000003
+	return h
+}
+
+BEGIN {
+	n = 0
+
+	for (i = 32; i < 127; ++i)
+		ord[sprintf("%c", i)] = i
+
+	compatibility["full"] = "COMPATIBILITY_FULL"
+	compatibility["high"] = "COMPATIBILITY_HIGH"
+	compatibility["subset"] = "COMPATIBILITY_SUBSET"
+}
+
+/^[ \t]*(#|$)/ { next }
+
+{
+	if (NF != 3 || $1 !~ /^[a-z][a-z0-9]*$/ || $2 !~ /^[0-9]+$/ || !($3 in compatibility) ||
+			($1 in ids)) {
+		printf "%s:%d: Invalid or duplicate entry.\n", FILENAME, FNR > "/dev/stderr"
+		exit 1
+	}
+
+	ids[$1] = n
+	names[n] = $1
+	costs[n] = $2
+	classes[n] = compatibility[$3]
+	++n
+}
+
+END {
+	if (n == 0) {
+		print "No implementations." > "/dev/stderr"
+		exit 1
+	}
+
+	# IDs are stored in the signed char IMPLEMENTATION_SLOTS.
+	if (n > 127) {
+		printf "Too many implementations: %d, at most 127 fit.\n", n > "/dev/stderr"
+		exit 1
+	}
+
+	for (size = 1; size < 2 * n; size *= 2)
+		;
+
+	for (seed = 0; seed < 1000000; ++seed) {
+		split("", slots)
+
+		for (i = 0; i < n; ++i) {
+			slot = hash(names[i], seed) % size
+
+			if (slot in slots)
+				break
+
+			slots[slot] = i
+		}
+
+		if (i == n)
+			break
+	}
+
+	if (seed == 1000000) {
+		print "No collision-free seed found." > "/dev/stderr"
+		exit 1
+	}
+
+	for (i = 0; i < n; ++i)
+		id = hash(names[i] "\n" id, 0)
+
+	print "/* Generated by gen-implementations.sh from implementations.list.  Do not edit. */"
+	print ""
+	printf "#define IMPLEMENTATION_HASH_SEED %dUL\n", seed
+	printf "#define IMPLEMENTATION_HASH_SIZE %d\n", size
+	printf "#define IMPLEMENTATION_TABLE_ID %dU\n", id
+	print ""
+	print "static const char *IMPLEMENTATIONS[] = {"
+
+	for (i = 0; i < n; ++i)
+		printf "\t\"%s\",\n", names[i]
+
+	print "\tNULL"
+	print "};"
+	print ""
+	print "static const implementation_class_t IMPLEMENTATION_CLASSES[] = {"
+
+	for (i = 0; i < n; ++i)
+		printf "\t{ %d, %s },\n", costs[i], classes[i]
+
+	print "};"
+	print ""
+	print "static const signed char IMPLEMENTATION_SLOTS[IMPLEMENTATION_HASH_SIZE] = {"
+
+	for (i = 0; i < size; ++i)
+		printf "%s%d%s", (i % 16 == 0 ? "\t" : " "), (i in slots ? slots[i] : -1),
+				(i == size - 1 ? "\n" : i % 16 == 15 ? ",\n" : ",")
+
+	print "};"
+}
+' "$list" > "$header.tmp" || { rm -f "$header.tmp"; exit 1; }
+
+mv "$header.tmp" "$header"
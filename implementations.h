@@ -0,0 +1,57 @@
+/* Generated by gen-implementations.sh from implementations.list.  Do not edit. */
+
+#define IMPLEMENTATION_HASH_SEED 0UL
+#define IMPLEMENTATION_HASH_SIZE 64
+#define IMPLEMENTATION_TABLE_ID 65519U
+
+static const char *IMPLEMENTATIONS[] = {
+	"ruby18",
+	"ruby19",
+	"ruby20",
+	"ruby21",
+	"ruby22",
+	"ruby23",
+	"ruby24",
+	"ruby25",
+	"ruby26",
+	"ruby27",
+	"ruby30",
+	"ruby31",
+	"ruby32",
+	"ruby33",
+	"ruby34",
+	"jruby",
+	"rbx",
+	"mruby",
+	"truffleruby",
+	NULL
+};
+
+static const implementation_class_t IMPLEMENTATION_CLASSES[] = {
+	{ 2, COMPATIBILITY_FULL },
+	{ 2, COMPATIBILITY_FULL },
+	{ 2, COMPATIBILITY_FULL },
+	{ 2, COMPATIBILITY_FULL },
+	{ 2, COMPATIBILITY_FULL },
+	{ 2, COMPATIBILITY_FULL },
+	{ 2, COMPATIBILITY_FULL },
+	{ 2, COMPATIBILITY_FULL },
+	{ 2, COMPATIBILITY_FULL },
+	{ 2, COMPATIBILITY_FULL },
+	{ 2, COMPATIBILITY_FULL },
+	{ 2, COMPATIBILITY_FULL },
+	{ 2, COMPATIBILITY_FULL },
+	{ 2, COMPATIBILITY_FULL },
+	{ 2, COMPATIBILITY_FULL },
+	{ 4, COMPATIBILITY_HIGH },
+	{ 3, COMPATIBILITY_HIGH },
+	{ 0, COMPATIBILITY_SUBSET },
+	{ 1, COMPATIBILITY_HIGH },
+};
+
+static const signed char IMPLEMENTATION_SLOTS[IMPLEMENTATION_HASH_SIZE] = {
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 16, -1, -1, -1,
+	-1, -1, -1, -1, 10, 11, 12, 13, 14, -1, 0, 1, -1, -1, -1, -1,
+	17, -1, -1, -1, -1, -1, -1, -1, -1, 15, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, 2, 3, 4, 5, 6, 7, 8, 9, -1, 18, -1, -1, -1
+};
@@ -0,0 +1,92 @@
+# frozen_string_literal: true
+
+require "rubyexec/spawn"
+
+module RubyExec
+  # Runs a rubyexec script in a forked copy of the current process instead of
+  # a new interpreter when rubyexec would pick the very interpreter already
+  # running, which saves the whole interpreter boot.  Scripts opt in with a
+  # magic comment in their first lines:
+  #
+  #   # rubyexec: fork-load
+  #
+  # The child keeps everything the parent has loaded, so a script that opts in
+  # must not depend on starting from a clean interpreter.  Handlers the parent
+  # registered with at_exit do not run in the child; the script's own do.
+  # Everything else is left to Process.spawn.
+  #
+  #   pid = RubyExec::ForkLoad.spawn("tools/report", "--daily")
+  module ForkLoad
+    MAGIC_COMMENT = /^#\s*rubyexec:\s*fork-load\s*$/.freeze
+    MAGIC_COMMENT_LINES = 5
+
+    class << self
+      def spawn(command, *args)
+        path = fork_loadable_path(command)
+        path ? fork { run(path, args) } : Process.spawn(command, *args)
+      end
+
+      def system(command, *args)
+        Process.wait(spawn(command, *args))
+        $?.success?
+      rescue SystemCallError
+        nil
+      end
+
+      private
+
+      def fork_loadable_path(command)
+        return nil unless args_plain?(command) && !Spawn.rubyexec_environment?
+
+        path = Spawn.find_command(command) or return nil
+        impl_path = Spawn.resolve(path) or return nil
+        return nil unless File.realpath(impl_path) == File.realpath("/proc/self/exe")
+
+        allowed?(path) ? path : nil
+      rescue SystemCallError
+        nil
+      end
+
+      def args_plain?(command)
+        command.is_a?(String) && !command.match?(Spawn::SHELL_CHARACTERS)
+      end
+
+      def allowed?(path)
+        File.foreach(path).first(MAGIC_COMMENT_LINES).any? { |line| line.match?(MAGIC_COMMENT) }
+      end
+
+      def run(path, args)
+        handlers = []
+        Kernel.define_method(:at_exit) { |&block| handlers << block; block }
+        Kernel.send(:private, :at_exit)
+        Kernel.define_singleton_method(:at_exit) { |&block| handlers << block; block }
+        # load() expands ./ paths in __FILE__ and searches $LOAD_PATH for other
+        # relative ones, so $0 gets the absolute path for __FILE__ == $0.
+        file = File.expand_path(path)
+        $0 = file
+        Process.setproctitle(path)
+        ARGV.replace(args.map(&:to_s))
+        status = 0
+
+        begin
+          load(file)
+        rescue SystemExit => e
+          status = e.status
+        rescue Exception => e # rubocop:disable Lint/RescueException
+          warn "#{path}: #{e.message} (#{e.class})", *e.backtrace.map { |line| "\tfrom #{line}" }
+          status = 1
+        end
+
+        handlers.reverse_each do |handler|
+          handler.call
+        rescue SystemExit => e
+          status = e.status
+        end
+
+        $stdout.flush
+        $stderr.flush
+        exit!(status)
+      end
+    end
+  end
+end
@@ -0,0 +1,112 @@
+# frozen_string_literal: true
+
+require "rubyexec/rubyexec"
+
+module RubyExec
+  # Makes Process.spawn, Kernel#spawn, Kernel#system and Kernel#exec run
+  # scripts whose shebang is rubyexec with the interpreter rubyexec would pick,
+  # saving the exec of rubyexec itself.  Commands that are not plainly such a
+  # script, and launches that need rubyexec's own options, go through the
+  # original methods unchanged.
+  #
+  #   require "rubyexec/spawn"
+  #
+  # Requires Ruby 3.0 or later, where prepending to Kernel affects Object.
+  module Spawn
+    SHEBANG_SIZE = 256
+    SHELL_CHARACTERS = /[\s*?{}\[\]<>()~&|\\$;'`"#=%]/.freeze
+
+    class << self
+      def rewrite(args)
+        args = args.dup
+        env = args.first.is_a?(Hash) ? args.shift : nil
+        options = args.last.is_a?(Hash) ? args.pop : nil
+        return nil if args.empty? || !args.all?(String)
+        return nil if args.size == 1 && args.first.match?(SHELL_CHARACTERS)
+        return nil if rubyexec_environment?(env)
+
+        command = find_command(args.first, env) or return nil
+        impl_path = resolve(command) or return nil
+        [env, impl_path, command, *args.drop(1), options].compact
+      end
+
+      def rubyexec_environment?(env = nil)
+        ENV.each_key.any? { |name| name.start_with?("RUBYEXEC_") } ||
+            (env && env.each_key.any? { |name| name.to_s.start_with?("RUBYEXEC_") })
+      end
+
+      def find_command(name, env = nil)
+        return (executable?(name) ? name : nil) if name.include?("/")
+
+        path = env && env.key?("PATH") ? env["PATH"] : ENV["PATH"]
+        path.to_s.split(File::PATH_SEPARATOR).each do |dir|
+          candidate = File.join(dir.empty? ? "." : dir, name)
+          return candidate if executable?(candidate)
+        end
+
+        nil
+      end
+
+      # Returns the interpreter rubyexec would run command with, or nil.
+      def resolve(command)
+        head = File.open(command, "rb") { |file| file.read(SHEBANG_SIZE) }.to_s
+        line = head[/\A#!([^\n]*)\n/, 1] or return nil
+        interpreter, spec = line.strip.split(/[ \t]+/, 2)
+        return nil unless spec && File.basename(interpreter) == "rubyexec"
+
+        result = RubyExec.resolve(spec, File.dirname(File.realpath(interpreter)))
+        result && result.first
+      rescue SystemCallError, IOError
+        nil
+      end
+
+      private
+
+      def executable?(path)
+        File.file?(path) && File.executable?(path)
+      end
+    end
+
+    module Hooks
+      def spawn(*args)
+        rewritten = Spawn.rewrite(args) or return super(*args)
+
+        begin
+          super(*rewritten)
+        rescue SystemCallError
+          super(*args)
+        end
+      end
+
+      def system(*args)
+        rewritten = Spawn.rewrite(args) or return super(*args)
+        result = super(*rewritten)
+        result.nil? ? super(*args) : result
+      end
+
+      def exec(*args)
+        rewritten = Spawn.rewrite(args) or return super(*args)
+
+        begin
+          super(*rewritten)
+        rescue SystemCallError
+          super(*args)
+        end
+      end
+    end
+
+    module PrivateHooks
+      include Hooks
+      private :spawn, :system, :exec
+    end
+
+    module ProcessHooks
+      include Hooks
+      undef_method :system
+    end
+  end
+end
+
+Kernel.prepend(RubyExec::Spawn::PrivateHooks)
+Kernel.singleton_class.prepend(RubyExec::Spawn::Hooks)
+Process.singleton_class.prepend(RubyExec::Spawn::ProcessHooks)
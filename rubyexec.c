@@ -21,25 +21,730 @@
  * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
+#define _GNU_SOURCE 1
+
 #include <assert.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <elf.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <libgen.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
-#define MAX_PATH_SIZE 1024
+#include "rubyexec.h"
+
+#define SYSTEM_CONFIG_PATH "/etc/rubyexec.conf"
+#define SNAPSHOT_NAME "rubyexec.snapshot"
+#define CONFIG_IMAGE_NAME "config-1.bin"
+#define CONFIG_IMAGE_VERSION 1
+
+typedef enum { COMPATIBILITY_FULL, COMPATIBILITY_HIGH, COMPATIBILITY_SUBSET } compatibility_t;
+
+typedef struct {
+	int startup_cost;             /* Rough boot time class; lower boots faster */
+	compatibility_t compatibility;
+} implementation_class_t;
+
+#include "implementations.h"
+
+/*
+ * The compiled form of the configuration files, mapped read-only by every
+ * launch.  Everything is addressed by offsets from the start of the image.
+ * An option list is a run of NUL-terminated options ended by an empty one.
+ */
+typedef struct {
+	char magic[8];
+	uint32_t version, size, implementation_count, table_id;
+	int64_t mtimes[2][2];      /* Of the system and user files; -1 if absent */
+	int64_t negative_ttl;      /* -1 if unset */
+	uint32_t options[];        /* Global, then per implementation; 0 if unset */
+} config_image_t;
+
+/* Build variants installed as <impl>.<suffix>, in order of preference */
+static const char *VARIANT_SUFFIXES[] = { "x86-64-v4", "x86-64-v3", "x86-64-v2", "pgo", NULL };
+
+static bool in(const char *const null_terminated[], const char *str)
+{
+	const char *const *p;
+
+	for (p = null_terminated; *p != NULL; ++p)
+		if (strcmp(*p, str) == 0)
+			return true;
+
+	return false;
+}
+
+static bool is_excluded(const char *const *exclude, const char *path)
+{
+	return exclude != NULL && in(exclude, path);
+}
+
+static bool copy_string(char *buf, size_t size, const char *str)
+{
+	size_t length = strlen(str);
+
+	if (length >= size)
+		return false;
+
+	memcpy(buf, str, length + 1);
+	return true;
+}
+
+static bool join_path(char *buf, size_t size, const char *dir, const char *name)
+{
+	int length = snprintf(buf, size, "%s/%s", dir, name);
+	return length >= 0 && (size_t) length < size;
+}
+
+static bool get_user_config_path(char *buf, size_t size)
+{
+	const char *base;
+
+	if ((base = getenv("XDG_CONFIG_HOME")) != NULL && *base == '/')
+		return join_path(buf, size, base, "rubyexec.conf");
+
+	return (base = getenv("HOME")) != NULL && *base == '/' &&
+			join_path(buf, size, base, ".config/rubyexec.conf");
+}
+
+/*
+ * Returns the x86-64 microarchitecture level (1 to 4) of the CPU, the same
+ * levels glibc-hwcaps uses, or 0 on other architectures.  The feature bits are
+ * read once by libgcc at startup, so this costs no more than a cached value.
+ */
+static int get_x86_64_level(void)
+{
+#if defined(__x86_64__) && defined(__GNUC__)
+	__builtin_cpu_init();
+
+	if (!__builtin_cpu_supports("popcnt") || !__builtin_cpu_supports("sse4.2") ||
+			!__builtin_cpu_supports("ssse3"))
+		return 1;
+
+	if (!__builtin_cpu_supports("avx2") || !__builtin_cpu_supports("bmi") ||
+			!__builtin_cpu_supports("bmi2") || !__builtin_cpu_supports("fma"))
+		return 2;
+
+	if (!__builtin_cpu_supports("avx512f") || !__builtin_cpu_supports("avx512bw") ||
+			!__builtin_cpu_supports("avx512cd") || !__builtin_cpu_supports("avx512dq") ||
+			!__builtin_cpu_supports("avx512vl"))
+		return 3;
+
+	return 4;
+#else
+	return 0;
+#endif
+}
+
+static bool strip_variant_suffix(char *impl_name)
+{
+	char *dot = strchr(impl_name, '.');
+
+	if (dot == NULL || !in(VARIANT_SUFFIXES, dot + 1))
+		return false;
+
+	*dot = '\0';
+	return true;
+}
+
+static void select_variant(char *impl_path, size_t size, const char *const *exclude)
+{
+	int level = get_x86_64_level();
+	char path[RUBYEXEC_PATH_SIZE];
+
+	for (const char **suffix = VARIANT_SUFFIXES; *suffix != NULL; ++suffix) {
+		if (strncmp(*suffix, "x86-64-v", 8) == 0 && (*suffix)[8] - '0' > level)
+			continue;
+
+		int length = snprintf(path, sizeof(path), "%s.%s", impl_path, *suffix);
+
+		if (length >= 0 && (size_t) length < size && !is_excluded(exclude, path) &&
+				access(path, X_OK) == 0) {
+			memcpy(impl_path, path, length + 1);
+			return;
+		}
+	}
+}
+
+/*
+ * Returns the ID of the implementation called name, or -1.  The generated
+ * table places every name in its own slot, so one comparison decides.
+ */
+static int find_implementation(const char *name)
+{
+	unsigned long hash = IMPLEMENTATION_HASH_SEED;
+
+	for (const char *p = name; *p != '\0'; ++p)
+		hash = (hash * 33 + (unsigned char) *p) % 1000003;
+
+	int id = IMPLEMENTATION_SLOTS[hash % IMPLEMENTATION_HASH_SIZE];
+	return id >= 0 && strcmp(IMPLEMENTATIONS[id], name) == 0 ? id : -1;
+}
+
+static implementation_class_t get_implementation_class(const char *name)
+{
+	return IMPLEMENTATION_CLASSES[find_implementation(name)];
+}
+
+static bool boots_before(const char *a, const char *b, const char *preferred)
+{
+	implementation_class_t x = get_implementation_class(a), y = get_implementation_class(b);
+
+	if (x.startup_cost != y.startup_cost)
+		return x.startup_cost < y.startup_cost;
+
+	return x.compatibility != y.compatibility ? x.compatibility < y.compatibility :
+			a == preferred;
+}
+
+/*
+ * Lists the spec's implementations in the order autopick tries them: as
+ * written, or with fast-start, cheapest to boot first, then most compatible,
+ * then preferred, the default, over the rest.
+ */
+static void get_candidates(const rubyexec_spec_t *spec, const char *preferred,
+		const char **candidates)
+{
+	size_t count = 0;
+
+	for (const char *const *p = spec->implementations; *p != NULL; ++p) {
+		size_t i = count++;
+
+		for (; spec->fast_start && i > 0 && boots_before(*p, candidates[i - 1], preferred); --i)
+			candidates[i] = candidates[i - 1];
+
+		candidates[i] = *p;
+	}
+
+	candidates[count] = NULL;
+}
+
+/* Whether the spec's own order or boot cost outranks the default */
+static bool overrides_default(const rubyexec_spec_t *spec)
+{
+	return spec->fast_start || spec->in_order;
+}
+
+const char *rubyexec_lookup_implementation(const char *name)
+{
+	int id = find_implementation(name);
+	return id == -1 ? NULL : IMPLEMENTATIONS[id];
+}
+
+rubyexec_status_t rubyexec_parse_spec(const char *str, char *buf, size_t size,
+		rubyexec_spec_t *spec)
+{
+	size_t implementation_count = 0, option_count = 0;
+	char *saveptr;
+
+	if (!copy_string(buf, size, str))
+		return RUBYEXEC_ERROR_TOO_LONG;
+
+	spec->implementations[0] = NULL;
+	spec->autopick = false;
+	spec->fast_start = false;
+	spec->in_order = false;
+
+	for (char *item = strtok_r(buf, ",", &saveptr); item != NULL;
+			item = strtok_r(NULL, ",", &saveptr)) {
+		if (*item == '-') {
+			if (option_count >= RUBYEXEC_MAX_SPEC_ITEMS)
+				return RUBYEXEC_ERROR_TOO_LONG;
+
+			if (strcmp(item, "-a") == 0 || strcmp(item, "--autopick") == 0)
+				spec->autopick = true;
+
+			spec->options[option_count++] = item;
+		} else if (strcmp(item, "fast-start") == 0) {
+			spec->fast_start = true;
+		} else if (strcmp(item, "in-order") == 0) {
+			spec->in_order = true;
+		} else {
+			const char *name = rubyexec_lookup_implementation(item);
+
+			if (name != NULL && !in(spec->implementations, name)) {
+				spec->implementations[implementation_count++] = name;
+				spec->implementations[implementation_count] = NULL;
+			}
+		}
+	}
+
+	spec->options[option_count] = NULL;
+	return implementation_count == 0 ? RUBYEXEC_ERROR_NO_VALID_IMPLEMENTATIONS : RUBYEXEC_OK;
+}
+
+rubyexec_status_t rubyexec_read_default(const char *dir, rubyexec_default_t *def)
+{
+	char link[RUBYEXEC_PATH_SIZE], target[RUBYEXEC_PATH_SIZE], name[RUBYEXEC_PATH_SIZE];
+
+	if (!join_path(link, sizeof(link), dir, "ruby"))
+		return RUBYEXEC_ERROR_TOO_LONG;
+
+	ssize_t size = readlink(link, target, sizeof(target));
+
+	if (size == -1 && errno != EINVAL)
+		return RUBYEXEC_ERROR_SYSTEM;
+
+	if (size >= (ssize_t) sizeof(target))
+		return RUBYEXEC_ERROR_TOO_LONG;
+
+	if (size == -1) {
+		/* Not a symlink; only probing can tell what it is. */
+		memcpy(def->path, link, sizeof(link));
+		def->name = NULL;
+		def->exact = true;
+		return RUBYEXEC_OK;
+	}
+
+	target[size] = '\0';
+
+	if (*target == '/' ? !copy_string(def->path, sizeof(def->path), target) :
+			!join_path(def->path, sizeof(def->path), dir, target))
+		return RUBYEXEC_ERROR_TOO_LONG;
+
+	const char *slash = strrchr(target, '/');
+	copy_string(name, sizeof(name), slash == NULL ? target : slash + 1);
+	def->exact = strip_variant_suffix(name);
+	def->name = rubyexec_lookup_implementation(name);
+	return RUBYEXEC_OK;
+}
+
+rubyexec_status_t rubyexec_select(const rubyexec_spec_t *spec, const char *dir,
+		const rubyexec_default_t *def, const char *const *exclude, char *impl_path, size_t size,
+		const char **impl_name)
+{
+	bool exact = def->exact;
+	const char *candidates[RUBYEXEC_MAX_SPEC_ITEMS + 1];
+
+	if (!overrides_default(spec) && def->name != NULL && in(spec->implementations, def->name) &&
+			!(spec->autopick && is_excluded(exclude, def->path))) {
+		if (!copy_string(impl_path, size, def->path))
+			return RUBYEXEC_ERROR_TOO_LONG;
+
+		*impl_name = def->name;
+	} else if (spec->autopick || overrides_default(spec)) {
+		const char **p;
+		get_candidates(spec, def->name, candidates);
+
+		for (p = candidates; *p != NULL; ++p) {
+			if (*p == def->name && !is_excluded(exclude, def->path)) {
+				if (!copy_string(impl_path, size, def->path))
+					return RUBYEXEC_ERROR_TOO_LONG;
+
+				break;
+			}
+
+			if (join_path(impl_path, size, dir, *p) && !is_excluded(exclude, impl_path) &&
+					access(impl_path, F_OK) == 0) {
+				exact = false;
+				break;
+			}
+		}
+
+		if (*p == NULL)
+			return RUBYEXEC_ERROR_NO_USABLE_IMPLEMENTATIONS;
+
+		*impl_name = *p;
+	} else {
+		return RUBYEXEC_ERROR_NOT_WANTED;
+	}
+
+	if (!exact)
+		select_variant(impl_path, size, exclude);
 
-static const char *IMPLEMENTATIONS[] = {
-	"ruby18", "ruby19", "ruby20", "ruby21", "ruby22", "ruby23", "ruby24", "ruby25", "ruby26",
-	"ruby27", "ruby30", "ruby31", "ruby32", "ruby33", "ruby34", "jruby", "rbx", NULL
+	return RUBYEXEC_OK;
+}
+
+rubyexec_status_t rubyexec_build_argv(const char *impl_path, const char *const *extra_args,
+		int extra_count, char *const *args, int arg_count, char **new_argv, size_t size)
+{
+	if ((size_t) extra_count + arg_count + 2 > size)
+		return RUBYEXEC_ERROR_TOO_LONG;
+
+	char **p = new_argv;
+	*p++ = (char *) impl_path;
+
+	for (int i = 0; i < extra_count; ++i)
+		*p++ = (char *) extra_args[i];
+
+	for (int i = 0; i < arg_count; ++i)
+		*p++ = args[i];
+
+	*p = NULL;
+	return RUBYEXEC_OK;
+}
+
+/* Whether a configuration file sets options, or may, if it cannot be read */
+static bool get_cache_dir_path(char *buf, size_t size)
+{
+	const char *dir = getenv("RUBYEXEC_CACHE_DIR"), *base;
+
+	if (dir != NULL && *dir == '/')
+		return copy_string(buf, size, dir);
+
+	if ((base = getenv("XDG_CACHE_HOME")) != NULL && *base == '/')
+		return join_path(buf, size, base, "rubyexec");
+
+	return (base = getenv("HOME")) != NULL && *base == '/' &&
+			join_path(buf, size, base, ".cache/rubyexec");
+}
+
+static size_t count_implementations(void)
+{
+	size_t count = 0;
+
+	while (IMPLEMENTATIONS[count] != NULL)
+		++count;
+
+	return count;
+}
+
+static void get_config_mtimes(char *const paths[2], int64_t mtimes[2][2])
+{
+	struct stat st;
+
+	for (int i = 0; i < 2; ++i) {
+		bool found = paths[i] != NULL && stat(paths[i], &st) == 0;
+		mtimes[i][0] = found ? st.st_mtim.tv_sec : -1;
+		mtimes[i][1] = found ? st.st_mtim.tv_nsec : -1;
+	}
+}
+
+static bool is_current_config(const config_image_t *image, size_t size,
+		const int64_t mtimes[2][2])
+{
+	size_t count = count_implementations();
+
+	if (size < sizeof(*image) + (count + 1) * sizeof(uint32_t) + 2 ||
+			memcmp(image->magic, "RBXCONF", 8) != 0 || image->version != CONFIG_IMAGE_VERSION ||
+			image->size != size || image->implementation_count != count ||
+			image->table_id != IMPLEMENTATION_TABLE_ID ||
+			memcmp(image->mtimes, mtimes, sizeof(image->mtimes)) != 0 ||
+			memcmp((const char *) image + size - 2, "\0", 2) != 0)
+		return false;
+
+	for (size_t i = 0; i <= count; ++i)
+		if (image->options[i] >= size)
+			return false;
+
+	return true;
+}
+
+/*
+ * Answers from the configuration image the launcher compiled, so that a
+ * hooked spawn parses no text.  A missing or stale image means rubyexec has
+ * not run since the files changed, and it is left to rubyexec to launch.
+ */
+bool rubyexec_has_launcher_settings(const char *dir)
+{
+	char path[RUBYEXEC_PATH_SIZE], user_path[RUBYEXEC_PATH_SIZE], cache_dir[RUBYEXEC_PATH_SIZE];
+	char system_path[] = SYSTEM_CONFIG_PATH, *paths[2] = { system_path, NULL };
+	int64_t mtimes[2][2];
+	bool found = true;
+	struct stat st;
+
+	if (!join_path(path, sizeof(path), dir, SNAPSHOT_NAME) || access(path, F_OK) == 0)
+		return true;
+
+	if (get_user_config_path(user_path, sizeof(user_path)))
+		paths[1] = user_path;
+
+	get_config_mtimes(paths, mtimes);
+
+	if (mtimes[0][0] == -1 && mtimes[1][0] == -1)
+		return false;
+
+	if (!get_cache_dir_path(cache_dir, sizeof(cache_dir)) ||
+			!join_path(path, sizeof(path), cache_dir, CONFIG_IMAGE_NAME))
+		return true;
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+	if (fd != -1 && fstat(fd, &st) == 0 && st.st_size > 0) {
+		const config_image_t *image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+		if (image != MAP_FAILED && is_current_config(image, st.st_size, mtimes)) {
+			found = false;
+
+			const char *base = (const char *) image;
+
+			for (size_t i = 0; i <= image->implementation_count && !found; ++i)
+				found = image->options[i] != 0 && base[image->options[i]] != '\0';
+		}
+
+		if (image != MAP_FAILED)
+			munmap((void *) image, st.st_size);
+	}
+
+	if (fd != -1)
+		close(fd);
+
+	return found;
+}
+
+const char *rubyexec_strerror(rubyexec_status_t status)
+{
+	switch (status) {
+	case RUBYEXEC_OK:
+		return "Success.";
+	case RUBYEXEC_ERROR_SYSTEM:
+		return "System error.";
+	case RUBYEXEC_ERROR_TOO_LONG:
+		return "Path or spec is too long.";
+	case RUBYEXEC_ERROR_NO_VALID_IMPLEMENTATIONS:
+		return "No valid implementations found.";
+	case RUBYEXEC_ERROR_NOT_WANTED:
+		return "Selected Ruby implementation not wanted.";
+	case RUBYEXEC_ERROR_NO_USABLE_IMPLEMENTATIONS:
+		return "No usable implementations found.";
+	}
+
+	return "Unknown error.";
+}
+
+#ifndef RUBYEXEC_LIBRARY
+
+extern char **environ;
+
+#define MAX_EXTRA_ARGS 16
+#define MAX_NUMA_NODES 1024
+#define DEFAULT_NEGATIVE_TTL 300
+#define MAX_AUDIT_THREADS 64
+#define SHEBANG_SIZE 256
+#define TEE_CHUNK_SIZE (64 * 1024)
+#define CONFIG_LINE_SIZE 4096
+
+#define ALTERNATIVES_LINK_DIR "/etc/alternatives/"
+#define MAX_ALTERNATIVES 32
+#define MAX_LAUNCH_BUDGET_US 60000000L
+#define MAX_OVERRUNS_SIZE (64 * 1024)
+#define RESOLVE_RETRIES 6
+#define RESOLVE_RETRY_DELAY_NS 1000000L
+#define SNAPSHOT_VERSION 2
+
+#define MPOL_BIND 2
+
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_SHIFT 13
+
+#define GC_TUNE_MIN_GC_COUNT 4
+#define GC_TUNE_MIN_HEAP_SLOTS 10000L
+#define GC_TUNE_MAX_HEAP_SLOTS 4000000L
+#define GC_TUNE_MIN_MALLOC_LIMIT (16L * 1024 * 1024)
+#define GC_TUNE_MAX_MALLOC_LIMIT (256L * 1024 * 1024)
+#define GC_TUNE_MAX_OLDMALLOC_LIMIT (512L * 1024 * 1024)
+#define GC_TUNE_MAX_HWM_GROWTH_PERCENT 25
+#define GC_TUNE_MAX_REGRESSIONS 3
+
+#define THREAD_TUNE_MIN_THREADS 4
+#define THREAD_TUNE_MIN_BLOCKING_PERCENT 50
+#define THREAD_TUNE_MAX_SLOWDOWN_PERCENT 10
+#define THREAD_TUNE_MAX_REGRESSIONS 2
+
+static const char GC_HOOK_NAME[] = "gc-hook-2.rb";
+
+static const char GC_HOOK[] =
+	"# Installed by rubyexec for --gc-tune.  Do not edit.\n"
+	"if (rubyexec_gc_state = ENV.delete(\"RUBYEXEC_GC_STATE\")) && GC.respond_to?(:stat)\n"
+	"  rubyexec_gc_base = ENV.delete(\"RUBYEXEC_GC_BASE_HWM\").to_i\n"
+	"  rubyexec_gc_regressions = ENV.delete(\"RUBYEXEC_GC_REGRESSIONS\").to_i\n"
+	"  ENV.delete(\"RUBYEXEC_GC_VARS\").to_s.split(\",\").each { |name| ENV.delete(name) }\n"
+	"\n"
+	"  at_exit do\n"
+	"    begin\n"
+	"      stat = GC.stat\n"
+	"      hwm = File.read(\"/proc/self/status\")[/^VmHWM:\\s*(\\d+)/, 1].to_i\n"
+	"      values = [stat[:heap_live_slots] || stat[:heap_live_num], stat[:minor_gc_count],\n"
+	"          stat[:major_gc_count], stat[:malloc_increase_bytes_limit],\n"
+	"          stat[:oldmalloc_increase_bytes_limit]].map { |value| value.to_i }\n"
+	"      values << hwm << (rubyexec_gc_base > 0 ? rubyexec_gc_base : hwm)\n"
+	"      values << (rubyexec_gc_base > 0 ? 1 : 0) << rubyexec_gc_regressions\n"
+	"      tmp = \"#{rubyexec_gc_state}.#{$$}\"\n"
+	"      File.open(tmp, \"w\") { |file| file.puts values.join(\" \") }\n"
+	"      File.rename(tmp, rubyexec_gc_state)\n"
+	"    rescue StandardError\n"
+	"    end\n"
+	"  end\n"
+	"end\n";
+
+static const char THREAD_HOOK_NAME[] = "thread-hook-2.rb";
+
+static const char THREAD_HOOK[] =
+	"# Installed by rubyexec for --thread-tune.  Do not edit.\n"
+	"if (rubyexec_thread_state = ENV.delete(\"RUBYEXEC_THREAD_STATE\"))\n"
+	"  rubyexec_thread_base = ENV.delete(\"RUBYEXEC_THREAD_BASE_WALL\").to_i\n"
+	"  rubyexec_thread_regressions = ENV.delete(\"RUBYEXEC_THREAD_REGRESSIONS\").to_i\n"
+	"  ENV.delete(\"RUBYEXEC_THREAD_VARS\").to_s.split(\",\").each { |name| ENV.delete(name) }\n"
+	"  rubyexec_thread_start = Process.clock_gettime(Process::CLOCK_MONOTONIC, :millisecond)\n"
+	"  rubyexec_thread_cpu =\n"
+	"      Process.clock_gettime(Process::CLOCK_PROCESS_CPUTIME_ID, :millisecond)\n"
+	"  rubyexec_thread_peak = [Thread.list.size]\n"
+	"\n"
+	"  Thread.singleton_class.prepend(Module.new do\n"
+	"    [:new, :start, :fork].each do |name|\n"
+	"      define_method(name) do |*args, &block|\n"
+	"        thread = super(*args, &block)\n"
+	"        count = Thread.list.size\n"
+	"        rubyexec_thread_peak[0] = count if count > rubyexec_thread_peak[0]\n"
+	"        thread\n"
+	"      end\n"
+	"\n"
+	"      ruby2_keywords(name)\n"
+	"    end\n"
+	"  end)\n"
+	"\n"
+	"  at_exit do\n"
+	"    begin\n"
+	"      wall = Process.clock_gettime(Process::CLOCK_MONOTONIC, :millisecond) -\n"
+	"          rubyexec_thread_start\n"
+	"      cpu = Process.clock_gettime(Process::CLOCK_PROCESS_CPUTIME_ID, :millisecond) -\n"
+	"          rubyexec_thread_cpu\n"
+	"      values = [rubyexec_thread_peak[0], cpu, wall,\n"
+	"          rubyexec_thread_base > 0 ? rubyexec_thread_base : wall,\n"
+	"          rubyexec_thread_base > 0 ? 1 : 0, rubyexec_thread_regressions]\n"
+	"      tmp = \"#{rubyexec_thread_state}.#{$$}\"\n"
+	"      File.open(tmp, \"w\") { |file| file.puts values.join(\" \") }\n"
+	"      File.rename(tmp, rubyexec_thread_state)\n"
+	"    rescue StandardError\n"
+	"    end\n"
+	"  end\n"
+	"end\n";
+
+typedef struct {
+	const char *name;
+	const char *library;
+	const char *variables[4];
+} allocator_profile_t;
+
+static const allocator_profile_t ALLOCATOR_PROFILES[] = {
+	{ "jemalloc", "libjemalloc.so.2", { "MALLOC_CONF=narenas:2", NULL } },
+	{ "mimalloc", "libmimalloc.so.2", { "MIMALLOC_ARENA_EAGER_COMMIT=0", NULL } },
+	{ "tcmalloc", "libtcmalloc_minimal.so.4", { NULL } },
+	{ "glibc", NULL, { "MALLOC_ARENA_MAX=2", NULL } },
+	{ NULL }
+};
+
+static const char *LIBRARY_DIRS[] = {
+	"/usr/local/lib64", "/usr/local/lib", "/usr/lib64", "/usr/lib", "/usr/lib/x86_64-linux-gnu",
+	"/usr/lib/aarch64-linux-gnu", "/lib64", "/lib", NULL
 };
 
-typedef struct { bool autopick; } options_t;
+typedef struct {
+	bool autopick, gc_tune, thread_tune;
+	const char *allocator, *cpus, *numa, *nice, *sched, *ioprio, *timer_slack;
+	const char *thp, *stack, *as, *data, *cgroup, *cpu_weight, *memory_high;
+	const char *tee_log, *tee_log_size, *launch_budget;
+	const char *const *spec_options;
+} options_t;
+
+static const char *ALTERNATIVES_DB_DIRS[] = {
+	"/var/lib/dpkg/alternatives", "/var/lib/alternatives", NULL
+};
+
+static const char *IOPRIO_CLASSES[] = { "none", "rt", "be", "idle", NULL };
+
+static const char PROBE_SCRIPT[] =
+	"print defined?(RUBY_ENGINE) ? RUBY_ENGINE : 'ruby', ' ', RUBY_VERSION, ' ', "
+	"defined?(RubyVM::YJIT) ? 1 : 0";
+
+typedef struct {
+	char key[96], build_id[41], engine[32], version[32], impl[32];
+	int yjit;
+} probe_t;
+
+typedef struct {
+	const rubyexec_spec_t *spec;
+	const char *dir;
+	const char *const *broken;
+	rubyexec_status_t status;
+	int error;
+	char impl_path[RUBYEXEC_PATH_SIZE];
+	const char *impl_name;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bool done;
+} resolution_t;
+
+typedef struct {
+	char *path;
+	struct stat script_st;
+	unsigned long long fingerprint;
+} launch_plan_t;
+
+typedef struct {
+	long priority;
+	const char *name; /* NULL if the alternative is not a known implementation */
+	char path[RUBYEXEC_PATH_SIZE];
+} alternative_t;
+
+typedef struct {
+	alternative_t items[MAX_ALTERNATIVES];
+	int count;
+} alternatives_t;
+
+typedef struct { unsigned char elf_class, data, machine[2]; } elf_abi_t;
+
+typedef struct {
+	const char *items[MAX_EXTRA_ARGS];
+	int count;
+} args_t;
+
+typedef struct {
+	long heap_live_slots, minor_gc_count, major_gc_count, malloc_limit, oldmalloc_limit;
+	long hwm, base_hwm, tuned, regressions;
+} gc_stats_t;
+
+typedef struct {
+	char *data;
+	size_t size, capacity;
+} buffer_t;
+
+static const config_image_t *config;
+
+/*
+ * The resolution state frozen by --freeze for read-only roots, in the same
+ * offset-only form as the configuration image, which it embeds.
+ */
+typedef struct {
+	char magic[8];
+	uint32_t version, size, implementation_count, variant_count, table_id;
+	uint32_t config;           /* Offset of the configuration image */
+	uint32_t default_path;     /* Offset of a string */
+	int32_t default_index;     /* -1 if not an implementation */
+	uint32_t default_exact;
+	uint32_t alternative_count;
+	uint32_t alternatives;     /* Offset of alternative_count frozen_alternative_t */
+	uint32_t installed[];      /* Bit 0: installed; bit 1 + i: has VARIANT_SUFFIXES[i] */
+} snapshot_t;
+
+typedef struct {
+	int32_t index;
+	uint32_t path;
+} frozen_alternative_t;
+
+typedef struct {
+	long peak_threads, cpu_ms, wall_ms, base_wall_ms, tuned, regressions;
+} thread_stats_t;
 
 static void die(const char *msg, ...)
 {
@@ -61,15 +766,25 @@ static void *do_malloc(size_t size)
 	return p;
 }
 
+static void *do_realloc(void *p, size_t size)
+{
+	p = realloc(p, size);
+
+	if (p == NULL)
+		die("Unable to allocate memory: %s\n", strerror(errno));
+
+	return p;
+}
+
 static char *resolve_path(const char *path)
 {
-	char buf[MAX_PATH_SIZE];
-	size_t size = readlink(path, buf, sizeof(buf));
+	char buf[RUBYEXEC_PATH_SIZE];
+	ssize_t size = readlink(path, buf, sizeof(buf));
 
 	if (size == -1)
 		die("Failed to resolve %s: %s\n", path, strerror(errno));
 
-	if (size >= sizeof(buf))
+	if (size >= (ssize_t) sizeof(buf))
 		die("Resolved path of %s is too long.\n", path);
 
 	buf[size] = '\0';
@@ -104,99 +819,3384 @@ static char *strconcat(const char *str1, ...)
 	return buf;
 }
 
-static bool in(const char *null_terminated[], const char *str)
+static void add_arg(args_t *args, const char *arg)
 {
-	const char **p;
+	if (args->count >= MAX_EXTRA_ARGS)
+		die("Too many extra interpreter arguments.\n");
 
-	for (p = null_terminated; *p != NULL; ++p)
-		if (strcmp(*p, str) == 0)
-			return true;
+	args->items[args->count++] = arg;
+}
 
-	return false;
+static unsigned long long hash_string(const char *str)
+{
+	unsigned long long hash = 14695981039346656037ULL;
+
+	for (; *str != '\0'; ++str)
+		hash = (hash ^ (unsigned char) *str) * 1099511628211ULL;
+
+	return hash;
 }
 
-static const char **get_valid_implementations_and_options(char *argv1, options_t *options)
+static bool make_dirs(char *path)
 {
-	const char **valid_implementations = do_malloc(sizeof(IMPLEMENTATIONS));
-	const char **p = valid_implementations;
-	*p = NULL;
-	options->autopick = false;
+	/* The directory usually exists, which one mkdir() tells. */
+	if (mkdir(path, 0755) == 0 || errno == EEXIST)
+		return true;
 
-	for (char *str = strtok(argv1, ","); str != NULL; str = strtok(NULL, ",")) {
-		if (strcmp(str, "-a") == 0 || strcmp(str, "--autopick") == 0) {
-			options->autopick = true;
-		} else if (*valid_implementations == NULL || !in(valid_implementations, str)) {
-			if (in(IMPLEMENTATIONS, str)) {
-				*p = str;
-				*++p = NULL;
-			}
+	for (char *p = path + 1; *p != '\0'; ++p) {
+		if (*p == '/') {
+			*p = '\0';
+			bool ok = mkdir(path, 0755) == 0 || errno == EEXIST;
+			*p = '/';
+
+			if (!ok)
+				return false;
 		}
 	}
 
-	if (*valid_implementations == NULL)
-		die("No valid implementations found.\n");
-
-	return valid_implementations;
+	return mkdir(path, 0755) == 0 || errno == EEXIST;
 }
 
-static char *autopick_implementation(char *dir, const char **valid_implementations)
+/* Returns the cache directory without creating it, for callers that only read. */
+static char *find_cache_dir(void)
 {
-	for (const char **p = valid_implementations; *p != NULL; ++p) {
-		char *path = strconcat(dir, "/", *p, NULL);
+	char path[RUBYEXEC_PATH_SIZE];
+	return get_cache_dir_path(path, sizeof(path)) ? strdup(path) : NULL;
+}
 
-		if (access(path, F_OK) == 0)
-			return path;
+static char *get_cache_dir(void)
+{
+	char *path = find_cache_dir();
 
-		free(path);
-	}
+	if (path == NULL || make_dirs(path))
+		return path;
 
-	die("No usable implementations found.\n");
+	free(path);
 	return NULL;
 }
 
-static char **create_new_argv(int argc, char **argv, const char *new_argv0)
+static bool write_file_atomically(const char *path, const char *data, size_t size)
 {
-	char **new_argv = do_malloc(argc * sizeof(*new_argv));
+	char pid[24];
+	snprintf(pid, sizeof(pid), ".%ld", (long) getpid());
+	char *tmp = strconcat(path, pid, NULL);
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	bool ok = fd != -1 && write(fd, data, size) == (ssize_t) size;
+
+	if (fd != -1 && close(fd) != 0)
+		ok = false;
 
-	for (int i = 2; i < argc; ++i)
-		new_argv[i - 1] = argv[i];
+	if (ok && rename(tmp, path) != 0)
+		ok = false;
 
-	new_argv[0] = strndup(new_argv0, MAX_PATH_SIZE);
-	new_argv[argc - 1] = NULL;
-	return new_argv;
+	if (!ok && fd != -1)
+		unlink(tmp);
+
+	free(tmp);
+	return ok;
 }
 
-int main(int argc, char **argv)
+static bool set_option(options_t *options, const char *str)
 {
-	if (argc < 2) {
-		fprintf(stderr, "rubyexec: Invalid number of arguments.\n");
-		return 2;
-	}
+	if (strcmp(str, "-a") == 0 || strcmp(str, "--autopick") == 0)
+		options->autopick = true;
+	else if (strcmp(str, "--gc-tune") == 0)
+		options->gc_tune = true;
+	else if (strcmp(str, "--thread-tune") == 0)
+		options->thread_tune = true;
+	else if (strncmp(str, "--allocator=", 12) == 0)
+		options->allocator = str + 12;
+	else if (strncmp(str, "--cpus=", 7) == 0)
+		options->cpus = str + 7;
+	else if (strncmp(str, "--numa=", 7) == 0)
+		options->numa = str + 7;
+	else if (strncmp(str, "--nice=", 7) == 0)
+		options->nice = str + 7;
+	else if (strncmp(str, "--sched=", 8) == 0)
+		options->sched = str + 8;
+	else if (strncmp(str, "--ioprio=", 9) == 0)
+		options->ioprio = str + 9;
+	else if (strncmp(str, "--timer-slack=", 14) == 0)
+		options->timer_slack = str + 14;
+	else if (strncmp(str, "--thp=", 6) == 0)
+		options->thp = str + 6;
+	else if (strncmp(str, "--stack=", 8) == 0)
+		options->stack = str + 8;
+	else if (strncmp(str, "--as=", 5) == 0)
+		options->as = str + 5;
+	else if (strncmp(str, "--data=", 7) == 0)
+		options->data = str + 7;
+	else if (strncmp(str, "--cgroup=", 9) == 0)
+		options->cgroup = str + 9;
+	else if (strncmp(str, "--cpu-weight=", 13) == 0)
+		options->cpu_weight = str + 13;
+	else if (strncmp(str, "--memory-high=", 14) == 0)
+		options->memory_high = str + 14;
+	else if (strncmp(str, "--tee-log=", 10) == 0)
+		options->tee_log = str + 10;
+	else if (strncmp(str, "--tee-log-size=", 15) == 0)
+		options->tee_log_size = str + 15;
+	else if (strncmp(str, "--launch-budget=", 16) == 0)
+		options->launch_budget = str + 16;
+	else
+		return false;
 
-	if (strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0) {
-		fprintf(stderr, "rubyexec: Usage: %s impl,...[,-a|,--autopick] [args]\n", argv[0]);
-		return 2;
-	}
+	return true;
+}
 
-	options_t options;
-	const char **valid_implementations = get_valid_implementations_and_options(argv[1], &options);
-	char *rubyexec = resolve_path("/proc/self/exe");
-	char *rubyexec_dir = dirname(rubyexec);
-	char *ruby = strconcat(rubyexec_dir, "/ruby", NULL);
-	char *resolved_ruby = resolve_path(ruby);
-	char *selected_impl = basename(resolved_ruby);
-	char *impl_path;
-
-	if (in(valid_implementations, selected_impl)) {
-		impl_path = *resolved_ruby == '/' ? resolved_ruby :
-				strconcat(rubyexec_dir, "/", resolved_ruby, NULL);
-	} else if (options.autopick) {
-		impl_path = autopick_implementation(rubyexec_dir, valid_implementations);
-	} else {
-		die("Selected Ruby implementation not wanted.\n");
-	}
+static void set_options_from_env(options_t *options, const char *name)
+{
+	const char *value = getenv(name);
+
+	if (value == NULL)
+		return;
+
+	char *copy = strdup(value), *saveptr;
+
+	for (char *str = strtok_r(copy, ",", &saveptr); str != NULL;
+			str = strtok_r(NULL, ",", &saveptr))
+		if (!set_option(options, str))
+			die("Invalid option in %s: %s\n", name, str);
+}
+
+static void get_config_paths(char *paths[2])
+{
+	char path[RUBYEXEC_PATH_SIZE];
+	paths[0] = strdup(SYSTEM_CONFIG_PATH);
+	paths[1] = get_user_config_path(path, sizeof(path)) ? strdup(path) : NULL;
+}
+
+static uint32_t append_data(buffer_t *buf, const void *data, size_t size)
+{
+	size_t offset = buf->size;
+
+	if (buf->size + size > buf->capacity) {
+		while (buf->size + size > buf->capacity)
+			buf->capacity = buf->capacity * 2 + 256;
+
+		buf->data = do_realloc(buf->data, buf->capacity);
+	}
+
+	memcpy(buf->data + offset, data, size);
+	buf->size += size;
+	return offset;
+}
+
+static char *trim(char *str)
+{
+	str += strspn(str, " \t");
+
+	for (char *end = str + strlen(str); end > str && isspace((unsigned char) end[-1]);)
+		*--end = '\0';
+
+	return str;
+}
+
+static void parse_config_file(const char *path, char **values, int64_t *negative_ttl)
+{
+	FILE *file = fopen(path, "re");
+	char line[CONFIG_LINE_SIZE];
+	options_t options = { .spec_options = NULL };
+
+	if (file == NULL) {
+		if (errno != ENOENT)
+			die("Failed to read %s: %s\n", path, strerror(errno));
+
+		return;
+	}
+
+	for (int number = 1; fgets(line, sizeof(line), file) != NULL; ++number) {
+		char *key = trim(line), *value = strchr(key, '=');
+
+		if (*key == '\0' || *key == '#')
+			continue;
+
+		if (value == NULL)
+			die("%s:%d: Expected NAME = VALUE.\n", path, number);
+
+		*value = '\0';
+		key = trim(key);
+		value = trim(value + 1);
+
+		if (strcmp(key, "negative-ttl") == 0) {
+			char *end;
+			long ttl = strtol(value, &end, 10);
+
+			if (end == value || *end != '\0' || ttl < 0)
+				die("%s:%d: Invalid negative-ttl: %s\n", path, number, value);
+
+			*negative_ttl = ttl;
+			continue;
+		}
+
+		int index = strcmp(key, "options") == 0 ? 0 : strncmp(key, "options.", 8) == 0 ?
+				find_implementation(key + 8) + 1 : -1;
+
+		if (index <= 0 && strcmp(key, "options") != 0)
+			die("%s:%d: Unknown setting: %s\n", path, number, key);
+
+		char *normalized = do_malloc(strlen(value) + 1), *saveptr;
+		*normalized = '\0';
+
+		for (char *str = strtok_r(value, ",", &saveptr); str != NULL;
+				str = strtok_r(NULL, ",", &saveptr)) {
+			if (!set_option(&options, str = trim(str)))
+				die("%s:%d: Invalid option: %s\n", path, number, str);
+
+			strcat(strcat(normalized, *normalized == '\0' ? "" : ","), str);
+		}
+
+		free(values[index]);
+		values[index] = normalized;
+	}
+
+	fclose(file);
+}
+
+/* Settings in the user's file replace those of the system file. */
+static config_image_t *compile_config(char *const paths[2], const int64_t mtimes[2][2])
+{
+	size_t count = count_implementations();
+	char **values = do_malloc((count + 1) * sizeof(*values));
+	int64_t negative_ttl = -1;
+	buffer_t buf = { NULL, 0, 0 };
+	config_image_t header = { .magic = "RBXCONF", .version = CONFIG_IMAGE_VERSION,
+			.implementation_count = count, .table_id = IMPLEMENTATION_TABLE_ID };
+
+	memset(values, 0, (count + 1) * sizeof(*values));
+
+	for (int i = 0; i < 2; ++i)
+		if (paths[i] != NULL && mtimes[i][0] != -1)
+			parse_config_file(paths[i], values, &negative_ttl);
+
+	memcpy(header.mtimes, mtimes, sizeof(header.mtimes));
+	header.negative_ttl = negative_ttl;
+	append_data(&buf, &header, sizeof(header));
+
+	for (size_t i = 0; i <= count; ++i)
+		append_data(&buf, &(uint32_t) { 0 }, sizeof(uint32_t));
+
+	for (size_t i = 0; i <= count; ++i) {
+		if (values[i] == NULL)
+			continue;
+
+		uint32_t offset = buf.size;
+		char *saveptr;
+
+		for (char *str = strtok_r(values[i], ",", &saveptr); str != NULL;
+				str = strtok_r(NULL, ",", &saveptr))
+			append_data(&buf, str, strlen(str) + 1);
+
+		append_data(&buf, "", 1);
+		((config_image_t *) buf.data)->options[i] = offset;
+		free(values[i]);
+	}
+
+	append_data(&buf, "\0", 2);
+	((config_image_t *) buf.data)->size = buf.size;
+	free(values);
+	return (config_image_t *) buf.data;
+}
+
+static char *get_config_image_path(void)
+{
+	char *cache_dir = get_cache_dir();
+	char *path = cache_dir == NULL ? NULL : strconcat(cache_dir, "/" CONFIG_IMAGE_NAME, NULL);
+	free(cache_dir);
+	return path;
+}
+
+/*
+ * Maps the compiled configuration, compiling it again first if either source
+ * file has changed since.  Launches only parse text after such a change.
+ */
+static void load_config(void)
+{
+	char *paths[2], *image_path = get_config_image_path();
+	int64_t mtimes[2][2];
+	struct stat st;
+	int fd = image_path == NULL ? -1 : open(image_path, O_RDONLY | O_CLOEXEC);
+
+	get_config_paths(paths);
+	get_config_mtimes(paths, mtimes);
+
+	if (fd != -1 && fstat(fd, &st) == 0 && st.st_size > 0) {
+		void *image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+		if (image != MAP_FAILED && is_current_config(image, st.st_size, mtimes))
+			config = image;
+		else if (image != MAP_FAILED)
+			munmap(image, st.st_size);
+	}
+
+	if (fd != -1)
+		close(fd);
+
+	if (config == NULL) {
+		config_image_t *image = compile_config(paths, mtimes);
+
+		if (image_path != NULL)
+			write_file_atomically(image_path, (const char *) image, image->size);
+
+		config = image;
+	}
+
+	free(paths[0]);
+	free(paths[1]);
+	free(image_path);
+}
+
+static int compile_config_command(void)
+{
+	char *paths[2], *image_path = get_config_image_path();
+	int64_t mtimes[2][2];
+
+	get_config_paths(paths);
+	get_config_mtimes(paths, mtimes);
+	config_image_t *image = compile_config(paths, mtimes);
+
+	if (image_path == NULL)
+		die("No cache directory for the compiled configuration.\n");
+
+	if (!write_file_atomically(image_path, (const char *) image, image->size))
+		die("Failed to write %s: %s\n", image_path, strerror(errno));
+
+	printf("%s\n", image_path);
+	return 0;
+}
+
+static void set_options_from_config(options_t *options, int index)
+{
+	if (config == NULL || index < 0 || config->options[index] == 0)
+		return;
+
+	for (const char *p = (const char *) config + config->options[index]; *p != '\0';
+			p += strlen(p) + 1)
+		set_option(options, p);
+}
+
+/*
+ * Options are applied from the configuration files, then RUBYEXEC_OPTIONS, then
+ * RUBYEXEC_OPTIONS_<IMPL> once an implementation is known, then the spec
+ * itself, so the most specific source wins.
+ */
+static void load_options(options_t *options, const char *impl_name)
+{
+	options->autopick = false;
+	options->gc_tune = false;
+	options->thread_tune = false;
+	options->allocator = NULL;
+	options->cpus = NULL;
+	options->numa = NULL;
+	options->nice = NULL;
+	options->sched = NULL;
+	options->ioprio = NULL;
+	options->timer_slack = NULL;
+	options->thp = NULL;
+	options->stack = NULL;
+	options->as = NULL;
+	options->data = NULL;
+	options->cgroup = NULL;
+	options->cpu_weight = NULL;
+	options->memory_high = NULL;
+	options->tee_log = NULL;
+	options->tee_log_size = NULL;
+	options->launch_budget = NULL;
+	set_options_from_config(options, 0);
+
+	if (impl_name != NULL)
+		set_options_from_config(options, find_implementation(impl_name) + 1);
+
+	set_options_from_env(options, "RUBYEXEC_OPTIONS");
+
+	if (impl_name != NULL) {
+		char *name = strconcat("RUBYEXEC_OPTIONS_", impl_name, NULL);
+
+		for (char *p = name + strlen("RUBYEXEC_OPTIONS_"); *p != '\0'; ++p)
+			*p = toupper((unsigned char) *p);
+
+		set_options_from_env(options, name);
+		free(name);
+	}
+
+	for (const char *const *p = options->spec_options; *p != NULL; ++p)
+		set_option(options, *p);
+}
+
+static bool get_file_key(const char *path, char *key, size_t size)
+{
+	struct stat st;
+
+	if (stat(path, &st) != 0)
+		return false;
+
+	snprintf(key, size, "%llx:%llx:%lld.%09ld:%lld", (unsigned long long) st.st_dev,
+			(unsigned long long) st.st_ino, (long long) st.st_mtim.tv_sec, st.st_mtim.tv_nsec,
+			(long long) st.st_size);
+	return true;
+}
+
+static bool read_at(int fd, void *buf, size_t size, off_t offset)
+{
+	return pread(fd, buf, size, offset) == (ssize_t) size;
+}
+
+/* Reads the GNU build ID note of an ELF file as hex, or "-" if it has none. */
+static void read_build_id(const char *path, char *build_id)
+{
+	strcpy(build_id, "-");
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	Elf64_Ehdr header;
+
+	if (fd == -1)
+		return;
+
+	if (!read_at(fd, &header, sizeof(header), 0) ||
+			memcmp(header.e_ident, ELFMAG, SELFMAG) != 0 ||
+			header.e_ident[EI_CLASS] != ELFCLASS64) {
+		close(fd);
+		return;
+	}
+
+	for (int i = 0; i < header.e_phnum; ++i) {
+		Elf64_Phdr phdr;
+
+		if (!read_at(fd, &phdr, sizeof(phdr), header.e_phoff + (off_t) i * header.e_phentsize))
+			break;
+
+		if (phdr.p_type != PT_NOTE || phdr.p_filesz > 4096)
+			continue;
+
+		unsigned char notes[4096];
+
+		if (!read_at(fd, notes, phdr.p_filesz, phdr.p_offset))
+			break;
+
+		for (size_t offset = 0; offset + sizeof(Elf64_Nhdr) <= phdr.p_filesz;) {
+			Elf64_Nhdr *note = (Elf64_Nhdr *) (notes + offset);
+			size_t name_offset = offset + sizeof(*note);
+			size_t desc_offset = name_offset + ((note->n_namesz + 3) & ~3U);
+			offset = desc_offset + ((note->n_descsz + 3) & ~3U);
+
+			if (offset > phdr.p_filesz)
+				break;
+
+			if (note->n_type == NT_GNU_BUILD_ID && note->n_namesz == 4 && note->n_descsz <= 20 &&
+					memcmp(notes + name_offset, "GNU", 4) == 0) {
+				for (size_t j = 0; j < note->n_descsz; ++j)
+					sprintf(build_id + j * 2, "%02x", notes[desc_offset + j]);
+
+				close(fd);
+				return;
+			}
+		}
+	}
+
+	close(fd);
+}
+
+/*
+ * The probe database is a list of lines in the cache directory, one per
+ * probed binary, keyed by device, inode, mtime and size.  Entries with a
+ * matching build ID are reused for copies of an already probed binary.
+ * Binaries that are not a known implementation are recorded too, with the
+ * implementation they claim or "-", so they are not booted again.
+ */
+static bool lookup_probe(const char *db_path, probe_t *probe)
+{
+	FILE *file = fopen(db_path, "re");
+	char line[256];
+	probe_t entry;
+
+	if (file == NULL)
+		return false;
+
+	while (fgets(line, sizeof(line), file) != NULL) {
+		if (sscanf(line, "%95s %40s %31s %31s %d %31s", entry.key, entry.build_id, entry.engine,
+				entry.version, &entry.yjit, entry.impl) != 6)
+			continue;
+
+		if (strcmp(entry.key, probe->key) == 0 || (strcmp(entry.build_id, "-") != 0 &&
+				strcmp(entry.build_id, probe->build_id) == 0)) {
+			strcpy(entry.key, probe->key);
+			*probe = entry;
+			fclose(file);
+			return true;
+		}
+	}
+
+	fclose(file);
+	return false;
+}
+
+static void record_probe(const char *db_path, const probe_t *probe)
+{
+	char line[256];
+	int length = snprintf(line, sizeof(line), "%s %s %s %s %d %s\n", probe->key, probe->build_id,
+			probe->engine, probe->version, probe->yjit, probe->impl);
+	int fd = open(db_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+
+	if (fd != -1) {
+		ssize_t written = write(fd, line, length);
+		(void) written;
+		close(fd);
+	}
+}
+
+static pid_t start_probe(const char *path, int *fd)
+{
+	int fds[2];
+
+	if (pipe2(fds, O_CLOEXEC) != 0)
+		return -1;
+
+	pid_t pid = fork();
+
+	if (pid == 0) {
+		int null = open("/dev/null", O_RDWR);
+		dup2(null, STDIN_FILENO);
+		dup2(fds[1], STDOUT_FILENO);
+		dup2(null, STDERR_FILENO);
+		unsetenv("RUBYOPT");
+		execl(path, path, "-e", PROBE_SCRIPT, (char *) NULL);
+		_exit(127);
+	}
+
+	close(fds[1]);
+
+	if (pid == -1) {
+		close(fds[0]);
+		return -1;
+	}
+
+	*fd = fds[0];
+	return pid;
+}
+
+/*
+ * Collects a probe's result.  Returns false only if the probe could not be
+ * waited for; an unrecognized binary gets "-" as its implementation.
+ */
+static bool finish_probe(pid_t pid, int fd, probe_t *probe)
+{
+	char buf[128];
+	size_t length = 0;
+	ssize_t n;
+	pid_t result;
+	int status;
+
+	while (length < sizeof(buf) - 1 &&
+			((n = read(fd, buf + length, sizeof(buf) - 1 - length)) > 0 ||
+			(n == -1 && errno == EINTR)))
+		length += n > 0 ? n : 0;
+
+	buf[length] = '\0';
+	close(fd);
+
+	while ((result = waitpid(pid, &status, 0)) == -1 && errno == EINTR)
+		;
+
+	if (result == -1)
+		return false;
+
+	int major, minor;
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0 ||
+			sscanf(buf, "%31s %31s %d", probe->engine, probe->version, &probe->yjit) != 3) {
+		strcpy(probe->engine, "-");
+		strcpy(probe->version, "-");
+		strcpy(probe->impl, "-");
+		probe->yjit = 0;
+	} else if (strcmp(probe->engine, "ruby") != 0) {
+		snprintf(probe->impl, sizeof(probe->impl), "%s", probe->engine);
+	} else if (sscanf(probe->version, "%d.%d", &major, &minor) == 2) {
+		snprintf(probe->impl, sizeof(probe->impl), "ruby%d%d", major, minor);
+	} else {
+		strcpy(probe->impl, "-");
+	}
+
+	return true;
+}
+
+static bool prepare_probe(const char *path, probe_t *probe)
+{
+	if (!get_file_key(path, probe->key, sizeof(probe->key)))
+		return false;
+
+	read_build_id(path, probe->build_id);
+	return true;
+}
+
+/*
+ * Identifies an interpreter binary whose name says nothing about its
+ * implementation, e.g. a hardlink or copy installed as ruby.  The binary is
+ * run once and the result, known or not, is remembered in the probe
+ * database.
+ */
+static bool identify_implementation(const char *path, probe_t *probe)
+{
+	if (!prepare_probe(path, probe))
+		return false;
+
+	char *cache_dir = get_cache_dir();
+	char *db_path = cache_dir == NULL ? NULL : strconcat(cache_dir, "/probes", NULL);
+	bool found = db_path != NULL && lookup_probe(db_path, probe);
+	int fd;
+	pid_t pid;
+
+	if (!found && (pid = start_probe(path, &fd)) != -1 &&
+			(found = finish_probe(pid, fd, probe)) && db_path != NULL)
+		record_probe(db_path, probe);
+
+	free(db_path);
+	free(cache_dir);
+	return found && find_implementation(probe->impl) != -1;
+}
+
+/*
+ * Implements --probe: probes the given binaries, or ruby and every installed
+ * implementation next to rubyexec, all at once, and records the results.
+ */
+static int probe_implementations(const char *dir, int count, char **paths)
+{
+	char **default_paths = NULL;
+
+	if (count == 0) {
+		default_paths = do_malloc((sizeof(IMPLEMENTATIONS) / sizeof(*IMPLEMENTATIONS) + 1) *
+				sizeof(*default_paths));
+		default_paths[count++] = strconcat(dir, "/ruby", NULL);
+
+		for (const char **p = IMPLEMENTATIONS; *p != NULL; ++p) {
+			char *path = strconcat(dir, "/", *p, NULL);
+
+			if (access(path, X_OK) == 0)
+				default_paths[count++] = path;
+			else
+				free(path);
+		}
+
+		paths = default_paths;
+	}
+
+	probe_t *probes = do_malloc(count * sizeof(*probes));
+	pid_t *pids = do_malloc(count * sizeof(*pids));
+	int *fds = do_malloc(count * sizeof(*fds));
+	char *cache_dir = get_cache_dir();
+	char *db_path = cache_dir == NULL ? NULL : strconcat(cache_dir, "/probes", NULL);
+	int status = 0;
+
+	/* -1 means the result was recorded already, -2 that there is none */
+	for (int i = 0; i < count; ++i) {
+		pids[i] = -1;
+
+		if (!prepare_probe(paths[i], &probes[i]))
+			pids[i] = -2;
+		else if ((db_path == NULL || !lookup_probe(db_path, &probes[i])) &&
+				(pids[i] = start_probe(paths[i], &fds[i])) == -1)
+			pids[i] = -2;
+	}
+
+	for (int i = 0; i < count; ++i) {
+		if (pids[i] >= 0 && !finish_probe(pids[i], fds[i], &probes[i]))
+			pids[i] = -2;
+		else if (pids[i] >= 0 && db_path != NULL)
+			record_probe(db_path, &probes[i]);
+
+		if (pids[i] == -2 || find_implementation(probes[i].impl) == -1) {
+			printf("%s: unknown\n", paths[i]);
+			status = 1;
+			continue;
+		}
+
+		printf("%s: %s (%s %s%s, build-id %s)\n", paths[i], probes[i].impl, probes[i].engine,
+				probes[i].version, probes[i].yjit ? ", yjit" : "", probes[i].build_id);
+	}
+
+	free(db_path);
+	free(cache_dir);
+	return status;
+}
+
+static long get_negative_ttl(void)
+{
+	const char *value = getenv("RUBYEXEC_NEGATIVE_TTL");
+	char *end;
+	long ttl;
+
+	if (value == NULL && config != NULL && config->negative_ttl >= 0)
+		return config->negative_ttl;
+
+	if (value == NULL || (ttl = strtol(value, &end, 10)) < 0 || end == value || *end != '\0')
+		return DEFAULT_NEGATIVE_TTL;
+
+	return ttl;
+}
+
+/*
+ * Returns the interpreters known not to execute: the ones already tried by
+ * this launch, passed along in RUBYEXEC_EXCLUDE, and unless use_cache is false,
+ * the unexpired entries of the negative cache.
+ */
+static const char **load_broken_implementations(bool use_cache)
+{
+	const char *exclude = getenv("RUBYEXEC_EXCLUDE");
+	size_t capacity = 16, count = 0;
+	const char **broken = do_malloc(capacity * sizeof(*broken));
+
+	if (exclude != NULL) {
+		char *copy = strdup(exclude), *saveptr;
+
+		for (char *path = strtok_r(copy, ":", &saveptr); path != NULL;
+				path = strtok_r(NULL, ":", &saveptr)) {
+			if (count + 1 >= capacity)
+				broken = do_realloc(broken, (capacity *= 2) * sizeof(*broken));
+
+			broken[count++] = path;
+		}
+
+		unsetenv("RUBYEXEC_EXCLUDE");
+	}
+
+	char *cache_dir = use_cache ? find_cache_dir() : NULL;
+	char *cache_path = cache_dir == NULL ? NULL : strconcat(cache_dir, "/broken", NULL);
+	FILE *file = cache_path == NULL ? NULL : fopen(cache_path, "re");
+	char line[RUBYEXEC_PATH_SIZE + 32];
+	time_t now = time(NULL);
+
+	while (file != NULL && fgets(line, sizeof(line), file) != NULL) {
+		long long expiry;
+		int offset;
+		line[strcspn(line, "\n")] = '\0';
+
+		if (sscanf(line, "%lld %n", &expiry, &offset) == 1 && expiry > now) {
+			if (count + 1 >= capacity)
+				broken = do_realloc(broken, (capacity *= 2) * sizeof(*broken));
+
+			broken[count++] = strdup(line + offset);
+		}
+	}
+
+	if (file != NULL)
+		fclose(file);
+
+	broken[count] = NULL;
+	free(cache_path);
+	free(cache_dir);
+	return broken;
+}
+
+static void record_broken_implementation(const char *impl_path)
+{
+	char *cache_dir = get_cache_dir();
+
+	if (cache_dir == NULL)
+		return;
+
+	char *cache_path = strconcat(cache_dir, "/broken", NULL);
+	FILE *file = fopen(cache_path, "re");
+	char line[RUBYEXEC_PATH_SIZE + 32], *data = NULL;
+	size_t size = 0;
+	FILE *out = open_memstream(&data, &size);
+	time_t now = time(NULL);
+
+	while (file != NULL && fgets(line, sizeof(line), file) != NULL) {
+		long long expiry;
+		int offset;
+
+		if (sscanf(line, "%lld %n", &expiry, &offset) != 1 || expiry <= now)
+			continue;
+
+		size_t length = strcspn(line + offset, "\n");
+
+		if (length != strlen(impl_path) || strncmp(line + offset, impl_path, length) != 0)
+			fputs(line, out);
+	}
+
+	if (file != NULL)
+		fclose(file);
+
+	fprintf(out, "%lld %s\n", (long long) now + get_negative_ttl(), impl_path);
+	fclose(out);
+	write_file_atomically(cache_path, data, size);
+	free(data);
+	free(cache_path);
+	free(cache_dir);
+}
+
+/* Whether path is a build variant, for which the plain binary can stand in. */
+static bool is_variant(const char *path)
+{
+	const char *slash = strrchr(path, '/');
+	char name[RUBYEXEC_PATH_SIZE];
+	return copy_string(name, sizeof(name), slash == NULL ? path : slash + 1) &&
+			strip_variant_suffix(name);
+}
+
+/*
+ * Runs rubyexec again with the original arguments and environment, excluding
+ * the interpreter that failed to execute, so the next acceptable one is
+ * picked by a clean launch in the same process.  A --tee-log writer already
+ * holds the output, so the new launch is told not to start another.
+ */
+static void retry_launch(char **argv, char **original_environ, const char **broken,
+		const char *impl_path, bool teeing)
+{
+	char *exclude = strdup(impl_path);
+	size_t count = 0;
+
+	for (const char **p = broken; *p != NULL; ++p) {
+		char *old = exclude;
+		exclude = strconcat(old, ":", *p, NULL);
+		free(old);
+	}
+
+	for (char **p = original_environ; *p != NULL; ++p)
+		++count;
+
+	char **envp = do_malloc((count + 3) * sizeof(*envp));
+	char **q = envp;
+
+	for (char **p = original_environ; *p != NULL; ++p)
+		if (strncmp(*p, "RUBYEXEC_EXCLUDE=", 17) != 0)
+			*q++ = *p;
+
+	*q++ = strconcat("RUBYEXEC_EXCLUDE=", exclude, NULL);
+
+	if (teeing)
+		*q++ = "RUBYEXEC_TEE_LOG_ACTIVE=1";
+
+	*q = NULL;
+	argv[0] = "rubyexec";
+	execve("/proc/self/exe", argv, envp);
+}
+
+/* Maps Debian's ruby3.1 and the like to ruby31, or else probes the binary. */
+static const char *identify_alternative(const char *path)
+{
+	const char *base = strrchr(path, '/');
+	base = base == NULL ? path : base + 1;
+	int major, minor, length;
+	char name[16];
+	probe_t probe;
+
+	if (sscanf(base, "ruby%1d.%1d%n", &major, &minor, &length) == 2 && base[length] == '\0') {
+		snprintf(name, sizeof(name), "ruby%d%d", major, minor);
+		return rubyexec_lookup_implementation(name);
+	}
+
+	if (rubyexec_lookup_implementation(base) != NULL)
+		return rubyexec_lookup_implementation(base);
+
+	return identify_implementation(path, &probe) ? rubyexec_lookup_implementation(probe.impl) :
+			NULL;
+}
+
+static int compare_alternatives(const void *a, const void *b)
+{
+	long x = ((const alternative_t *) a)->priority, y = ((const alternative_t *) b)->priority;
+	return x < y ? 1 : x > y ? -1 : 0;
+}
+
+/*
+ * Parses the update-alternatives database of dpkg or of chkconfig: the mode,
+ * the master link and pairs of slave names and links up to an empty line,
+ * then for each alternative its path, its priority either on the same line
+ * or the next, and one line per slave.
+ */
+static bool parse_alternatives_db(FILE *file, alternatives_t *alts)
+{
+	char line[RUBYEXEC_PATH_SIZE + 32];
+	int slave_count = 0;
+
+	for (int i = 0; fgets(line, sizeof(line), file) != NULL; ++i) {
+		if (i >= 2 && *line == '\n')
+			break;
+
+		if (i >= 2 && i % 2 == 0)
+			++slave_count;
+	}
+
+	alts->count = 0;
+
+	while (alts->count < MAX_ALTERNATIVES && fgets(line, sizeof(line), file) != NULL &&
+			*line != '\n') {
+		alternative_t *alt = &alts->items[alts->count];
+		char *priority = line + strcspn(line, " \t\n");
+
+		if (*priority != '\n' && *priority != '\0') {
+			*priority++ = '\0';
+		} else {
+			*priority = '\0';
+			priority = NULL;
+		}
+
+		if (!copy_string(alt->path, sizeof(alt->path), line))
+			return false;
+
+		if (priority == NULL && (priority = fgets(line, sizeof(line), file)) == NULL)
+			return false;
+
+		alt->priority = strtol(priority, NULL, 10);
+
+		for (int i = 0; i < slave_count; ++i)
+			if (fgets(line, sizeof(line), file) == NULL)
+				return false;
+
+		++alts->count;
+	}
+
+	for (int i = 0; i < alts->count; ++i)
+		alts->items[i].name = identify_alternative(alts->items[i].path);
+
+	qsort(alts->items, alts->count, sizeof(*alts->items), compare_alternatives);
+	return true;
+}
+
+static bool read_alternatives_cache(const char *path, const struct stat *db_st,
+		alternatives_t *alts)
+{
+	FILE *file = fopen(path, "re");
+	char line[RUBYEXEC_PATH_SIZE + 64];
+	long long sec, nsec;
+	bool ok = false;
+
+	if (file == NULL)
+		return false;
+
+	if (fgets(line, sizeof(line), file) != NULL && sscanf(line, "%lld %lld", &sec, &nsec) == 2 &&
+			sec == db_st->st_mtim.tv_sec && nsec == db_st->st_mtim.tv_nsec) {
+		ok = true;
+
+		for (alts->count = 0; ok && alts->count < MAX_ALTERNATIVES &&
+				fgets(line, sizeof(line), file) != NULL; ++alts->count) {
+			alternative_t *alt = &alts->items[alts->count];
+			char name[32];
+			int offset;
+			line[strcspn(line, "\n")] = '\0';
+			ok = sscanf(line, "%ld %31s %n", &alt->priority, name, &offset) == 2 &&
+					copy_string(alt->path, sizeof(alt->path), line + offset);
+			alt->name = rubyexec_lookup_implementation(name);
+		}
+	}
+
+	fclose(file);
+	return ok;
+}
+
+static void write_alternatives_cache(const char *path, const struct stat *db_st,
+		const alternatives_t *alts)
+{
+	size_t size = 64 + alts->count * (RUBYEXEC_PATH_SIZE + 64);
+	char *data = do_malloc(size);
+	int length = snprintf(data, size, "%lld %lld\n", (long long) db_st->st_mtim.tv_sec,
+			(long long) db_st->st_mtim.tv_nsec);
+
+	for (int i = 0; i < alts->count; ++i)
+		length += snprintf(data + length, size - length, "%ld %s %s\n", alts->items[i].priority,
+				alts->items[i].name == NULL ? "-" : alts->items[i].name, alts->items[i].path);
+
+	write_file_atomically(path, data, length);
+	free(data);
+}
+
+/*
+ * Reads the alternatives behind a ruby symlink that points into
+ * /etc/alternatives, ordered by priority.  The parsed and identified list is
+ * cached until the database's mtime changes, so other hosts pay nothing and
+ * alternatives hosts pay a stat() and a small read.
+ */
+static bool load_alternatives(const char *link_target, alternatives_t *alts)
+{
+	if (strncmp(link_target, ALTERNATIVES_LINK_DIR, strlen(ALTERNATIVES_LINK_DIR)) != 0)
+		return false;
+
+	const char *group = link_target + strlen(ALTERNATIVES_LINK_DIR);
+	char *db_path = NULL;
+	struct stat st;
+
+	for (const char **dir = ALTERNATIVES_DB_DIRS; *dir != NULL && db_path == NULL; ++dir) {
+		db_path = strconcat(*dir, "/", group, NULL);
+
+		if (stat(db_path, &st) != 0) {
+			free(db_path);
+			db_path = NULL;
+		}
+	}
+
+	if (db_path == NULL)
+		return false;
+
+	char *cache_dir = get_cache_dir();
+	char *cache_path = cache_dir == NULL ? NULL :
+			strconcat(cache_dir, "/alternatives-", group, NULL);
+	bool ok = cache_path != NULL && read_alternatives_cache(cache_path, &st, alts);
+
+	if (!ok) {
+		FILE *file = fopen(db_path, "re");
+		ok = file != NULL && parse_alternatives_db(file, alts);
+
+		if (file != NULL)
+			fclose(file);
+
+		if (ok && cache_path != NULL)
+			write_alternatives_cache(cache_path, &st, alts);
+	}
+
+	free(cache_path);
+	free(cache_dir);
+	free(db_path);
+	return ok;
+}
+
+/*
+ * Makes the default the active alternative, or, when the spec does not want
+ * it and allows autopick, the highest-priority alternative it does want.
+ */
+static void apply_alternatives(const rubyexec_spec_t *spec, const char *const *exclude,
+		rubyexec_default_t *def)
+{
+	alternatives_t alts;
+	char target[RUBYEXEC_PATH_SIZE];
+
+	if (!load_alternatives(def->path, &alts))
+		return;
+
+	ssize_t size = readlink(def->path, target, sizeof(target) - 1);
+
+	if (size > 0) {
+		target[size] = '\0';
+
+		for (int i = 0; i < alts.count; ++i) {
+			if (strcmp(alts.items[i].path, target) == 0) {
+				copy_string(def->path, sizeof(def->path), target);
+				def->name = alts.items[i].name;
+				def->exact = true;
+				break;
+			}
+		}
+	}
+
+	if (!spec->autopick || (def->name != NULL && in(spec->implementations, def->name) &&
+			!is_excluded(exclude, def->path)))
+		return;
+
+	for (int i = 0; i < alts.count; ++i) {
+		const alternative_t *alt = &alts.items[i];
+
+		if (alt->name != NULL && in(spec->implementations, alt->name) &&
+				!is_excluded(exclude, alt->path) && access(alt->path, X_OK) == 0) {
+			copy_string(def->path, sizeof(def->path), alt->path);
+			def->name = alt->name;
+			def->exact = true;
+			return;
+		}
+	}
+}
+
+static int get_mri_version(const char *impl_name)
+{
+	if (strncmp(impl_name, "ruby", 4) != 0 || strlen(impl_name) != 6)
+		return 0;
+
+	return atoi(impl_name + 4);
+}
+
+/*
+ * Returns the spec for rubyexec installed under another name: the contents
+ * of a <name>.spec file next to the rubyexec binary, or a spec derived from
+ * the name itself for ruby-X.Y, ruby-X.Y+ (X.Y or newer) and ruby-mri-latest.
+ * Returns NULL for names that do not select anything, so renamed copies keep
+ * working as rubyexec.
+ */
+static char *get_multi_call_spec(const char *argv0)
+{
+	const char *name = strrchr(argv0, '/');
+	name = name == NULL ? argv0 : name + 1;
+
+	if (strcmp(name, "rubyexec") == 0)
+		return NULL;
+
+	/* Never relative to argv[0], which is as typed when run from PATH */
+	char *exe_path = resolve_path("/proc/self/exe");
+	char *spec_path = strconcat(dirname(exe_path), "/", name, ".spec", NULL);
+	FILE *file = fopen(spec_path, "re");
+	free(spec_path);
+	free(exe_path);
+
+	if (file != NULL) {
+		char buf[RUBYEXEC_PATH_SIZE];
+		char *line = fgets(buf, sizeof(buf), file);
+		fclose(file);
+
+		if (line == NULL || (buf[strcspn(buf, "\n")] = '\0', *buf == '\0'))
+			die("Empty spec file for %s.\n", name);
+
+		return strdup(buf);
+	}
+
+	int major, minor, min_version, max_version, length;
+
+	if (strcmp(name, "ruby-mri-latest") == 0) {
+		min_version = 0;
+		max_version = 99;
+	} else if (sscanf(name, "ruby-%1d.%1d%n", &major, &minor, &length) == 2 &&
+			(name[length] == '\0' || strcmp(name + length, "+") == 0)) {
+		min_version = major * 10 + minor;
+		max_version = name[length] == '+' ? 99 : min_version;
+	} else {
+		return NULL;
+	}
+
+	size_t count = sizeof(IMPLEMENTATIONS) / sizeof(*IMPLEMENTATIONS) - 1;
+	char *spec = do_malloc(sizeof("in-order,") + count * 7 + sizeof("-a"));
+	/* ruby-mri-latest means the newest installed MRI, whatever the default */
+	strcpy(spec, max_version == 99 && min_version == 0 ? "in-order," : "");
+
+	for (size_t i = count; i-- > 0;) {
+		int version = get_mri_version(IMPLEMENTATIONS[i]);
+
+		if (version != 0 && version >= min_version && version <= max_version) {
+			strcat(spec, IMPLEMENTATIONS[i]);
+			strcat(spec, ",");
+		}
+	}
+
+	strcat(spec, "-a");
+	return spec;
+}
+
+static long clamp(long value, long min, long max)
+{
+	return value < min ? min : value > max ? max : value;
+}
+
+static bool read_gc_stats(const char *path, gc_stats_t *stats)
+{
+	FILE *file = fopen(path, "re");
+
+	if (file == NULL)
+		return false;
+
+	int n = fscanf(file, "%ld %ld %ld %ld %ld %ld %ld %ld %ld", &stats->heap_live_slots,
+			&stats->minor_gc_count, &stats->major_gc_count, &stats->malloc_limit,
+			&stats->oldmalloc_limit, &stats->hwm, &stats->base_hwm, &stats->tuned,
+			&stats->regressions);
+	fclose(file);
+	return n == 9;
+}
+
+static void set_tuning_variable(const char *name, long value, char *vars, size_t vars_size)
+{
+	if (getenv(name) != NULL)
+		return;
+
+	char buf[24];
+	snprintf(buf, sizeof(buf), "%ld", value);
+	setenv(name, buf, 1);
+
+	if (*vars != '\0')
+		strncat(vars, ",", vars_size - strlen(vars) - 1);
+
+	strncat(vars, name, vars_size - strlen(vars) - 1);
+}
+
+static char *install_hook(const char *cache_dir, const char *name, const char *source)
+{
+	char *hook_path = strconcat(cache_dir, "/", name, NULL);
+
+	if (access(hook_path, R_OK) != 0 &&
+			!write_file_atomically(hook_path, source, strlen(source))) {
+		free(hook_path);
+		return NULL;
+	}
+
+	return hook_path;
+}
+
+static char *get_script_state_path(const char *cache_dir, const char *prefix,
+		const char *impl_name, const char *script_path)
+{
+	char key[40];
+	snprintf(key, sizeof(key), "-%016llx", hash_string(script_path));
+	return strconcat(cache_dir, "/", prefix, "-", impl_name, key, NULL);
+}
+
+/*
+ * Derives RUBY_GC_* variables from the statistics the hook recorded on the
+ * previous run of the same script under the same implementation.  Tuning is
+ * skipped for one run whenever the last tuned run's peak RSS grew too far past
+ * the untuned baseline, which lets the next run record a fresh baseline.  The
+ * regression is counted in the state file: each one halves the heap slots and
+ * malloc limits of later tuned runs, and after GC_TUNE_MAX_REGRESSIONS the
+ * script is no longer tuned under that implementation.
+ */
+static void prepare_gc_tuning(const char *impl_name, const char *script, args_t *extra_args)
+{
+	int version = get_mri_version(impl_name);
+
+	if (version == 0 || script == NULL)
+		return;
+
+	char *cache_dir = get_cache_dir();
+	char *script_path = realpath(script, NULL);
+
+	if (cache_dir == NULL || script_path == NULL) {
+		free(cache_dir);
+		free(script_path);
+		return;
+	}
+
+	char *hook_path = install_hook(cache_dir, GC_HOOK_NAME, GC_HOOK);
+
+	if (hook_path == NULL) {
+		free(cache_dir);
+		free(script_path);
+		return;
+	}
+
+	char *state_path = get_script_state_path(cache_dir, "gc", impl_name, script_path);
+	gc_stats_t stats;
+	long base_hwm = 0, regressions = 0;
+	bool ok = read_gc_stats(state_path, &stats);
+
+	if (ok && (regressions = stats.regressions) < GC_TUNE_MAX_REGRESSIONS && stats.tuned &&
+			stats.hwm * 100 > stats.base_hwm * (100 + GC_TUNE_MAX_HWM_GROWTH_PERCENT)) {
+		++regressions;
+	} else if (ok && regressions < GC_TUNE_MAX_REGRESSIONS && (stats.tuned ||
+			stats.minor_gc_count + stats.major_gc_count >= GC_TUNE_MIN_GC_COUNT)) {
+		char vars[128] = "";
+		long slots = clamp((stats.heap_live_slots / 4 * 5) >> regressions, GC_TUNE_MIN_HEAP_SLOTS,
+				GC_TUNE_MAX_HEAP_SLOTS);
+		long malloc_limit = clamp(stats.malloc_limit >> regressions, GC_TUNE_MIN_MALLOC_LIMIT,
+				GC_TUNE_MAX_MALLOC_LIMIT);
+		long oldmalloc_limit = clamp(stats.oldmalloc_limit >> regressions,
+				GC_TUNE_MIN_MALLOC_LIMIT, GC_TUNE_MAX_OLDMALLOC_LIMIT);
+		set_tuning_variable(version >= 33 ? "RUBY_GC_HEAP_0_INIT_SLOTS" :
+				"RUBY_GC_HEAP_INIT_SLOTS", slots, vars, sizeof(vars));
+		set_tuning_variable("RUBY_GC_MALLOC_LIMIT", malloc_limit, vars, sizeof(vars));
+		set_tuning_variable("RUBY_GC_OLDMALLOC_LIMIT", oldmalloc_limit, vars, sizeof(vars));
+		setenv("RUBYEXEC_GC_VARS", vars, 1);
+		base_hwm = stats.base_hwm;
+	}
+
+	char buf[24];
+	snprintf(buf, sizeof(buf), "%ld", base_hwm);
+	setenv("RUBYEXEC_GC_BASE_HWM", buf, 1);
+	snprintf(buf, sizeof(buf), "%ld", regressions);
+	setenv("RUBYEXEC_GC_REGRESSIONS", buf, 1);
+	setenv("RUBYEXEC_GC_STATE", state_path, 1);
+	add_arg(extra_args, "-r");
+	add_arg(extra_args, hook_path);
+	free(state_path);
+	free(cache_dir);
+	free(script_path);
+}
+
+static bool read_thread_stats(const char *path, thread_stats_t *stats)
+{
+	FILE *file = fopen(path, "re");
+
+	if (file == NULL)
+		return false;
+
+	int n = fscanf(file, "%ld %ld %ld %ld %ld %ld", &stats->peak_threads, &stats->cpu_ms,
+			&stats->wall_ms, &stats->base_wall_ms, &stats->tuned, &stats->regressions);
+	fclose(file);
+	return n == 6;
+}
+
+/*
+ * Enables M:N threads on ruby33+ for scripts whose previous run had many
+ * threads that mostly waited, judged by the share of wall time not spent on
+ * CPU.  RUBY_MAX_CPU is capped at the peak thread count and the online CPUs.
+ * Like --gc-tune, tuning is skipped for one run whenever the last tuned run
+ * was slower than the untuned baseline, and the regression is counted in the
+ * state file.  Each one halves RUBY_MAX_CPU for later tuned runs, and after
+ * THREAD_TUNE_MAX_REGRESSIONS the script keeps native threads.
+ */
+static void prepare_thread_tuning(const char *impl_name, const char *script, args_t *extra_args)
+{
+	if (get_mri_version(impl_name) < 33 || script == NULL)
+		return;
+
+	char *cache_dir = get_cache_dir();
+	char *script_path = realpath(script, NULL);
+	char *hook_path = cache_dir != NULL && script_path != NULL ?
+			install_hook(cache_dir, THREAD_HOOK_NAME, THREAD_HOOK) : NULL;
+
+	if (hook_path == NULL) {
+		free(cache_dir);
+		free(script_path);
+		return;
+	}
+
+	char *state_path = get_script_state_path(cache_dir, "threads", impl_name, script_path);
+	thread_stats_t stats;
+	long base_wall = 0, regressions = 0;
+	bool ok = read_thread_stats(state_path, &stats);
+
+	if (ok && (regressions = stats.regressions) < THREAD_TUNE_MAX_REGRESSIONS && stats.tuned &&
+			stats.wall_ms * 100 > stats.base_wall_ms * (100 + THREAD_TUNE_MAX_SLOWDOWN_PERCENT)) {
+		++regressions;
+	} else if (ok && regressions < THREAD_TUNE_MAX_REGRESSIONS &&
+			stats.peak_threads >= THREAD_TUNE_MIN_THREADS &&
+			(stats.wall_ms - stats.cpu_ms) * 100 >=
+			stats.wall_ms * THREAD_TUNE_MIN_BLOCKING_PERCENT) {
+		char vars[64] = "";
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		set_tuning_variable("RUBY_MN_THREADS", 1, vars, sizeof(vars));
+		set_tuning_variable("RUBY_MAX_CPU", clamp(stats.peak_threads >> regressions, 1,
+				cpus < 1 ? 1 : cpus), vars, sizeof(vars));
+		setenv("RUBYEXEC_THREAD_VARS", vars, 1);
+		base_wall = stats.base_wall_ms > 0 ? stats.base_wall_ms : 1;
+	}
+
+	char buf[24];
+	snprintf(buf, sizeof(buf), "%ld", base_wall);
+	setenv("RUBYEXEC_THREAD_BASE_WALL", buf, 1);
+	snprintf(buf, sizeof(buf), "%ld", regressions);
+	setenv("RUBYEXEC_THREAD_REGRESSIONS", buf, 1);
+	setenv("RUBYEXEC_THREAD_STATE", state_path, 1);
+	add_arg(extra_args, "-r");
+	add_arg(extra_args, hook_path);
+	free(state_path);
+	free(cache_dir);
+	free(script_path);
+}
+
+/*
+ * With RUBYEXEC_PERF=1, adds the flags that let perf and similar profilers
+ * symbolize Ruby and JIT frames.  On ruby33+ built with YJIT, --yjit-perf
+ * enables YJIT with frame pointers and writes /tmp/perf-PID.map.  On JRuby,
+ * the JVM keeps frame pointers in JIT code and writes its perf map at exit.
+ * Probing is not allowed when resolving from a snapshot, so only known
+ * probe results count then.
+ */
+static void prepare_perf_flags(const char *impl_name, const char *impl_path, bool may_probe,
+		args_t *extra_args)
+{
+	const char *value = getenv("RUBYEXEC_PERF");
+	probe_t probe;
+
+	if (value == NULL || strcmp(value, "1") != 0)
+		return;
+
+	if (get_mri_version(impl_name) >= 33) {
+		char *cache_dir = may_probe ? NULL : find_cache_dir();
+		char *db_path = cache_dir == NULL ? NULL : strconcat(cache_dir, "/probes", NULL);
+
+		if ((may_probe ? identify_implementation(impl_path, &probe) : db_path != NULL &&
+				prepare_probe(impl_path, &probe) && lookup_probe(db_path, &probe)) && probe.yjit)
+			add_arg(extra_args, "--yjit-perf");
+
+		free(db_path);
+		free(cache_dir);
+	} else if (strcmp(impl_name, "jruby") == 0) {
+		add_arg(extra_args, "-J-XX:+IgnoreUnrecognizedVMOptions");
+		add_arg(extra_args, "-J-XX:+PreserveFramePointer");
+		add_arg(extra_args, "-J-XX:+UnlockDiagnosticVMOptions");
+		add_arg(extra_args, "-J-XX:+DumpPerfMapAtExit");
+	}
+}
+
+static bool read_elf_abi(const char *path, elf_abi_t *abi)
+{
+	Elf32_Ehdr header;
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+	if (fd == -1)
+		return false;
+
+	bool ok = read(fd, &header, sizeof(header)) == sizeof(header) &&
+			memcmp(header.e_ident, ELFMAG, SELFMAG) == 0;
+	close(fd);
+
+	if (ok) {
+		abi->elf_class = header.e_ident[EI_CLASS];
+		abi->data = header.e_ident[EI_DATA];
+		memcpy(abi->machine, &header.e_machine, sizeof(abi->machine));
+	}
+
+	return ok;
+}
+
+static char *find_allocator_library(const char *library, const char *impl_path)
+{
+	elf_abi_t impl_abi, library_abi;
+
+	/* Implementations like jruby are launched by scripts; match our own ABI then. */
+	if (!read_elf_abi(impl_path, &impl_abi) && !read_elf_abi("/proc/self/exe", &impl_abi))
+		return NULL;
+
+	for (const char **dir = LIBRARY_DIRS; *dir != NULL; ++dir) {
+		char *path = strconcat(*dir, "/", library, NULL);
+
+		if (read_elf_abi(path, &library_abi) &&
+				memcmp(&impl_abi, &library_abi, sizeof(impl_abi)) == 0)
+			return path;
+
+		free(path);
+	}
+
+	return NULL;
+}
+
+static void apply_allocator_profile(const char *name, const char *impl_path)
+{
+	if (strcmp(name, "none") == 0)
+		return;
+
+	const allocator_profile_t *profile = ALLOCATOR_PROFILES;
+
+	while (profile->name != NULL && strcmp(profile->name, name) != 0)
+		++profile;
+
+	if (profile->name == NULL)
+		die("Unknown allocator profile: %s\n", name);
+
+	if (profile->library != NULL) {
+		char *library = find_allocator_library(profile->library, impl_path);
+
+		if (library == NULL)
+			return;
+
+		const char *preload = getenv("LD_PRELOAD");
+		setenv("LD_PRELOAD", preload == NULL || *preload == '\0' ? library :
+				strconcat(library, ":", preload, NULL), 1);
+	}
+
+	for (const char *const *variable = profile->variables; *variable != NULL; ++variable) {
+		char *copy = strdup(*variable);
+		char *value = strchr(copy, '=');
+		*value++ = '\0';
+		setenv(copy, value, 0);
+		free(copy);
+	}
+}
+
+/*
+ * Parses a CPU list like "0-3,8-11".  Colons are accepted in place of commas
+ * since commas already separate the items of a spec.
+ */
+static bool parse_cpu_list(const char *list, cpu_set_t *set)
+{
+	CPU_ZERO(set);
+
+	while (*list != '\0') {
+		char *end;
+		long first = strtol(list, &end, 10), last = first;
+
+		if (end == list || first < 0)
+			return false;
+
+		if (*end == '-') {
+			list = end + 1;
+			last = strtol(list, &end, 10);
+
+			if (end == list || last < first)
+				return false;
+		}
+
+		if (last >= CPU_SETSIZE)
+			return false;
+
+		for (long cpu = first; cpu <= last; ++cpu)
+			CPU_SET(cpu, set);
+
+		if (*end == ',' || *end == ':')
+			++end;
+		else if (*end != '\0' && *end != '\n')
+			return false;
+		else
+			break;
+
+		list = end;
+	}
+
+	return CPU_COUNT(set) > 0;
+}
+
+static char *read_sysfs_line(const char *path)
+{
+	char buf[4096];
+	FILE *file = fopen(path, "re");
+
+	if (file == NULL)
+		return NULL;
+
+	char *line = fgets(buf, sizeof(buf), file);
+	fclose(file);
+	return line == NULL ? NULL : strdup(line);
+}
+
+static long get_node_free_memory(long node)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%ld/meminfo", node);
+	FILE *file = fopen(path, "re");
+
+	if (file == NULL)
+		return -1;
+
+	char line[256];
+	long free_kb = -1;
+
+	while (fgets(line, sizeof(line), file) != NULL)
+		if (sscanf(line, "Node %*d MemFree: %ld kB", &free_kb) == 1)
+			break;
+
+	fclose(file);
+	return free_kb;
+}
+
+/* The least-loaded node is the one with the most free memory. */
+static long find_least_loaded_node(void)
+{
+	DIR *dir = opendir("/sys/devices/system/node");
+
+	if (dir == NULL)
+		die("Failed to read NUMA nodes: %s\n", strerror(errno));
+
+	struct dirent *entry;
+	long best_node = -1, best_free = -1;
+
+	while ((entry = readdir(dir)) != NULL) {
+		char *end;
+
+		if (strncmp(entry->d_name, "node", 4) != 0 || !isdigit((unsigned char) entry->d_name[4]))
+			continue;
+
+		long node = strtol(entry->d_name + 4, &end, 10), free_kb;
+
+		if (*end == '\0' && (free_kb = get_node_free_memory(node)) > best_free) {
+			best_node = node;
+			best_free = free_kb;
+		}
+	}
+
+	closedir(dir);
+
+	if (best_node == -1)
+		die("No NUMA nodes found.\n");
+
+	return best_node;
+}
+
+/*
+ * Affinity and memory policy are both inherited across execv(), so setting
+ * them here places the interpreter without a numactl or taskset hop.  A NUMA
+ * node also restricts the CPUs to the node's own unless --cpus is given.
+ */
+static void apply_placement(const options_t *options)
+{
+	cpu_set_t cpus;
+	bool have_cpus = false;
+
+	if (options->cpus != NULL) {
+		if (!parse_cpu_list(options->cpus, &cpus))
+			die("Invalid CPU list: %s\n", options->cpus);
+
+		have_cpus = true;
+	}
+
+	if (options->numa != NULL) {
+		long node;
+		char *end;
+
+		if (strcmp(options->numa, "least-loaded") == 0)
+			node = find_least_loaded_node();
+		else if ((node = strtol(options->numa, &end, 10)) < 0 || end == options->numa ||
+				*end != '\0' || node >= MAX_NUMA_NODES)
+			die("Invalid NUMA node: %s\n", options->numa);
+
+		unsigned long nodemask[MAX_NUMA_NODES / (8 * sizeof(unsigned long))] = { 0 };
+		nodemask[node / (8 * sizeof(unsigned long))] |=
+				1UL << (node % (8 * sizeof(unsigned long)));
+
+		if (syscall(SYS_set_mempolicy, MPOL_BIND, nodemask, MAX_NUMA_NODES + 1) != 0)
+			die("Failed to bind memory to NUMA node %ld: %s\n", node, strerror(errno));
+
+		if (!have_cpus) {
+			char path[64];
+			snprintf(path, sizeof(path), "/sys/devices/system/node/node%ld/cpulist", node);
+			char *list = read_sysfs_line(path);
+
+			if (list == NULL || !parse_cpu_list(list, &cpus))
+				die("Failed to read CPUs of NUMA node %ld.\n", node);
+
+			free(list);
+			have_cpus = true;
+		}
+	}
+
+	if (have_cpus && sched_setaffinity(0, sizeof(cpus), &cpus) != 0)
+		die("Failed to set CPU affinity: %s\n", strerror(errno));
+}
+
+static bool parse_long(const char *str, long min, long max, long *value)
+{
+	char *end;
+	errno = 0;
+	*value = strtol(str, &end, 10);
+	return errno == 0 && end != str && *end == '\0' && *value >= min && *value <= max;
+}
+
+static void apply_scheduling(const options_t *options)
+{
+	long value;
+
+	if (options->nice != NULL) {
+		if (!parse_long(options->nice, -20, 19, &value))
+			die("Invalid nice value: %s\n", options->nice);
+
+		if (setpriority(PRIO_PROCESS, 0, value) != 0)
+			die("Failed to set nice value: %s\n", strerror(errno));
+	}
+
+	if (options->sched != NULL) {
+		int policy;
+		struct sched_param param = { .sched_priority = 0 };
+
+		if (strcmp(options->sched, "batch") == 0)
+			policy = SCHED_BATCH;
+		else if (strcmp(options->sched, "idle") == 0)
+			policy = SCHED_IDLE;
+		else if (strcmp(options->sched, "other") == 0)
+			policy = SCHED_OTHER;
+		else
+			die("Invalid scheduling policy: %s\n", options->sched);
+
+		if (sched_setscheduler(0, policy, &param) != 0)
+			die("Failed to set scheduling policy: %s\n", strerror(errno));
+	}
+
+	if (options->ioprio != NULL) {
+		char *copy = strdup(options->ioprio);
+		char *level_str = strchr(copy, ':');
+		long class = 0, level = 0;
+
+		if (level_str != NULL)
+			*level_str++ = '\0';
+
+		while (IOPRIO_CLASSES[class] != NULL && strcmp(IOPRIO_CLASSES[class], copy) != 0)
+			++class;
+
+		if (IOPRIO_CLASSES[class] == NULL ||
+				(level_str != NULL && !parse_long(level_str, 0, 7, &level)))
+			die("Invalid I/O priority: %s\n", options->ioprio);
+
+		if (level_str == NULL && (strcmp(copy, "rt") == 0 || strcmp(copy, "be") == 0))
+			level = 4;
+
+		if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+				(int) (class << IOPRIO_CLASS_SHIFT | level)) != 0)
+			die("Failed to set I/O priority: %s\n", strerror(errno));
+
+		free(copy);
+	}
+
+	if (options->timer_slack != NULL) {
+		if (!parse_long(options->timer_slack, 1, LONG_MAX, &value))
+			die("Invalid timer slack: %s\n", options->timer_slack);
+
+		if (prctl(PR_SET_TIMERSLACK, (unsigned long) value, 0, 0, 0) != 0)
+			die("Failed to set timer slack: %s\n", strerror(errno));
+	}
+}
+
+static bool parse_size(const char *str, rlim_t *size)
+{
+	if (strcmp(str, "unlimited") == 0) {
+		*size = RLIM_INFINITY;
+		return true;
+	}
+
+	char *end;
+	errno = 0;
+	unsigned long long value = strtoull(str, &end, 10);
+	int shift = 0;
+
+	if (errno != 0 || end == str || *str == '-')
+		return false;
+
+	switch (*end) {
+	case 'G': case 'g': shift = 30; break;
+	case 'M': case 'm': shift = 20; break;
+	case 'K': case 'k': shift = 10; break;
+	case '\0': break;
+	default: return false;
+	}
+
+	if (shift != 0 && *++end != '\0')
+		return false;
+
+	if (value > (RLIM_INFINITY - 1) >> shift)
+		return false;
+
+	*size = (rlim_t) value << shift;
+	return true;
+}
+
+static void set_limit(int resource, const char *name, const char *str)
+{
+	struct rlimit limit;
+	rlim_t size;
+
+	if (!parse_size(str, &size))
+		die("Invalid %s limit: %s\n", name, str);
+
+	if (getrlimit(resource, &limit) != 0)
+		die("Failed to get %s limit: %s\n", name, strerror(errno));
+
+	limit.rlim_cur = size;
+
+	if (setrlimit(resource, &limit) != 0)
+		die("Failed to set %s limit to %s: %s\n", name, str, strerror(errno));
+}
+
+/* PR_SET_THP_DISABLE and resource limits are both inherited across execv(). */
+static void apply_memory_limits(const options_t *options)
+{
+	if (options->thp != NULL) {
+		unsigned long disable;
+
+		if (strcmp(options->thp, "off") == 0)
+			disable = 1;
+		else if (strcmp(options->thp, "on") == 0)
+			disable = 0;
+		else
+			die("Invalid THP setting: %s\n", options->thp);
+
+		if (prctl(PR_SET_THP_DISABLE, disable, 0, 0, 0) != 0)
+			die("Failed to change THP setting: %s\n", strerror(errno));
+	}
+
+	if (options->stack != NULL)
+		set_limit(RLIMIT_STACK, "stack", options->stack);
+
+	if (options->as != NULL)
+		set_limit(RLIMIT_AS, "address space", options->as);
+
+	if (options->data != NULL)
+		set_limit(RLIMIT_DATA, "data", options->data);
+}
+
+static bool write_string(const char *path, const char *str)
+{
+	int fd = open(path, O_WRONLY | O_CLOEXEC);
+
+	if (fd == -1)
+		return false;
+
+	bool ok = write(fd, str, strlen(str)) == (ssize_t) strlen(str);
+	return close(fd) == 0 && ok;
+}
+
+static const char *get_cgroup2_mount(void)
+{
+	if (access("/sys/fs/cgroup/cgroup.controllers", F_OK) == 0)
+		return "/sys/fs/cgroup";
+
+	if (access("/sys/fs/cgroup/unified/cgroup.controllers", F_OK) == 0)
+		return "/sys/fs/cgroup/unified";
+
+	die("No cgroup v2 hierarchy found.\n");
+	return NULL;
+}
+
+static char *get_current_cgroup(void)
+{
+	char line[RUBYEXEC_PATH_SIZE];
+	FILE *file = fopen("/proc/self/cgroup", "re");
+
+	if (file == NULL)
+		die("Failed to read /proc/self/cgroup: %s\n", strerror(errno));
+
+	while (fgets(line, sizeof(line), file) != NULL) {
+		if (strncmp(line, "0::", 3) == 0) {
+			fclose(file);
+			line[strcspn(line, "\n")] = '\0';
+			return strdup(line + 3);
+		}
+	}
+
+	fclose(file);
+	die("Not running in a cgroup v2 hierarchy.\n");
+	return NULL;
+}
+
+/*
+ * Enables the controllers a new cgroup needs in its parent and writes its
+ * settings.  Returns the path of the file that could not be written, with
+ * errno set, or NULL.
+ */
+static char *configure_cgroup(const char *parent, const char *path, const options_t *options,
+		const char *memory_high)
+{
+	char *failed = NULL;
+	char *controllers = strconcat(options->cpu_weight != NULL ? " +cpu" : "",
+			memory_high != NULL ? " +memory" : "", NULL);
+	char *subtree_control = strconcat(parent, "/cgroup.subtree_control", NULL);
+	char *cpu_weight = strconcat(path, "/cpu.weight", NULL);
+	char *memory_high_file = strconcat(path, "/memory.high", NULL);
+
+	if (*controllers != '\0' && !write_string(subtree_control, controllers + 1))
+		failed = strdup(subtree_control);
+	else if (options->cpu_weight != NULL && !write_string(cpu_weight, options->cpu_weight))
+		failed = strdup(cpu_weight);
+	else if (memory_high != NULL && !write_string(memory_high_file, memory_high))
+		failed = strdup(memory_high_file);
+
+	int error = errno;
+	free(memory_high_file);
+	free(cpu_weight);
+	free(subtree_control);
+	free(controllers);
+	errno = error;
+	return failed;
+}
+
+/*
+ * Moves rubyexec into a cgroup before execv() so the interpreter starts
+ * there.  A relative name is created next to the caller's cgroup, i.e. inside
+ * the delegated subtree whose leaf the caller runs in; an absolute one is
+ * taken from the root of the hierarchy.  The cgroup is created and its
+ * cpu.weight and memory.high written only on first use, so the usual cost is
+ * a single write to cgroup.procs.
+ */
+static void apply_cgroup(const options_t *options)
+{
+	const char *mount = get_cgroup2_mount();
+	char *parent;
+
+	if (*options->cgroup == '/') {
+		parent = strdup(mount);
+	} else {
+		char *current_dir = dirname(get_current_cgroup());
+		parent = strcmp(current_dir, "/") == 0 ? strdup(mount) :
+				strconcat(mount, current_dir, NULL);
+	}
+
+	char *path = strconcat(parent, *options->cgroup == '/' ? "" : "/", options->cgroup, NULL);
+	char *procs = strconcat(path, "/cgroup.procs", NULL);
+
+	if (!write_string(procs, "0")) {
+		if (errno != ENOENT)
+			die("Failed to move into cgroup %s: %s\n", path, strerror(errno));
+
+		char memory_high[24], *memory_high_value = NULL;
+		rlim_t size;
+
+		if (options->memory_high != NULL) {
+			if (!parse_size(options->memory_high, &size))
+				die("Invalid memory.high value: %s\n", options->memory_high);
+
+			if (size == RLIM_INFINITY)
+				strcpy(memory_high, "max");
+			else
+				snprintf(memory_high, sizeof(memory_high), "%llu", (unsigned long long) size);
+
+			memory_high_value = memory_high;
+		}
+
+		bool created = mkdir(path, 0755) == 0;
+
+		if (!created && errno != EEXIST)
+			die("Failed to create cgroup %s: %s\n", path, strerror(errno));
+
+		/* A group left unconfigured would be used as is by every later launch. */
+		char *failed = configure_cgroup(dirname(strdup(path)), path, options, memory_high_value);
+
+		if (failed != NULL) {
+			int error = errno;
+
+			if (created)
+				rmdir(path);
+
+			die("Failed to configure cgroup %s: %s: %s\n", path, failed, strerror(error));
+		}
+
+		if (!write_string(procs, "0"))
+			die("Failed to move into cgroup %s: %s\n", path, strerror(errno));
+	}
+
+	free(procs);
+	free(path);
+	free(parent);
+}
+
+typedef struct {
+	int in, copy[2], out;
+} tee_stream_t;
+
+typedef struct {
+	const char *path;
+	int fd;
+	off_t size, max_size;
+} tee_log_t;
+
+static int open_log(const char *path, int flags, off_t *size)
+{
+	/* splice() refuses files opened with O_APPEND, so the end is found with lseek(). */
+	int fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC | O_NOCTTY | flags, 0644);
+
+	if (fd != -1 && (*size = lseek(fd, 0, SEEK_END)) == -1) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/*
+ * Copies through user space for destinations splice() refuses, such as files
+ * opened with O_APPEND by the caller's shell.
+ */
+static ssize_t copy_chunk(int in, int out, size_t size)
+{
+	char buf[4096];
+	ssize_t n = read(in, buf, size < sizeof(buf) ? size : sizeof(buf));
+
+	for (ssize_t done = 0; n > 0 && done < n;) {
+		ssize_t written = write(out, buf + done, n - done);
+
+		if (written == -1 && errno != EINTR)
+			return -1;
+
+		done += written > 0 ? written : 0;
+	}
+
+	return n;
+}
+
+/* Moves exactly size bytes from the pipe in to out, or to sink once out fails. */
+static void splice_all(int in, int *out, int sink, size_t size)
+{
+	bool copy = false;
+
+	while (size > 0) {
+		int fd = *out != -1 ? *out : sink;
+		ssize_t n = copy ? copy_chunk(in, fd, size) :
+				splice(in, NULL, fd, NULL, size, SPLICE_F_MOVE);
+
+		if (n > 0) {
+			size -= n;
+		} else if (n == -1 && errno == EAGAIN && *out != -1) {
+			struct pollfd pfd = { .fd = *out, .events = POLLOUT };
+			poll(&pfd, 1, -1);
+		} else if (n == -1 && errno == EINTR) {
+			continue;
+		} else if (n == -1 && errno == EINVAL && !copy) {
+			copy = true;
+		} else if (*out != -1) {
+			*out = -1;
+			copy = false;
+		} else {
+			_exit(1);
+		}
+	}
+}
+
+static void rotate_log(tee_log_t *log, size_t incoming)
+{
+	if (log->fd == -1 || log->max_size <= 0 || log->size == 0 ||
+			log->size + (off_t) incoming <= log->max_size)
+		return;
+
+	char *rotated = strconcat(log->path, ".1", NULL);
+	close(log->fd);
+	log->fd = rename(log->path, rotated) == 0 ? open_log(log->path, O_TRUNC, &log->size) :
+			open_log(log->path, 0, &log->size);
+	free(rotated);
+}
+
+/*
+ * Runs in the writer process until the interpreter and everything it started
+ * have closed the pipes.  Each chunk is duplicated with tee() into a second
+ * pipe that is spliced into the log, then spliced from the first pipe to the
+ * original descriptor, so the data never passes through user space.
+ */
+static void run_tee_log(tee_stream_t *streams, int count, tee_log_t *log)
+{
+	struct pollfd pfds[2];
+	int sink = open("/dev/null", O_WRONLY | O_CLOEXEC);
+
+	signal(SIGINT, SIG_IGN);
+	signal(SIGQUIT, SIG_IGN);
+	signal(SIGHUP, SIG_IGN);
+	signal(SIGTERM, SIG_IGN);
+	signal(SIGPIPE, SIG_IGN);
+
+	for (int i = 0; i < count; ++i)
+		pfds[i] = (struct pollfd) { .fd = streams[i].in, .events = POLLIN };
+
+	for (int open_count = count; open_count > 0;) {
+		if (poll(pfds, count, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+
+			_exit(1);
+		}
+
+		for (int i = 0; i < count; ++i) {
+			if (pfds[i].fd == -1 || pfds[i].revents == 0)
+				continue;
+
+			tee_stream_t *stream = &streams[i];
+			ssize_t n = tee(stream->in, stream->copy[1], TEE_CHUNK_SIZE, 0);
+
+			if (n == -1 && (errno == EINTR || errno == EAGAIN))
+				continue;
+
+			if (n <= 0) {
+				pfds[i].fd = -1;
+				--open_count;
+				continue;
+			}
+
+			rotate_log(log, n);
+			splice_all(stream->copy[0], &log->fd, sink, n);
+			log->size += n;
+			splice_all(stream->in, &stream->out, sink, n);
+		}
+	}
+
+	_exit(0);
+}
+
+static void make_pipe(int fds[2])
+{
+	if (pipe2(fds, O_CLOEXEC) != 0)
+		die("Failed to create pipe: %s\n", strerror(errno));
+}
+
+/*
+ * Redirects stdout and stderr through pipes to a detached writer process that
+ * copies them to their original destinations and to the log, keeping one
+ * rotated log once it grows past the size limit.  The interpreter keeps this
+ * process's PID, so exit statuses and signals reach it unchanged.  If both
+ * descriptors refer to the same file, they share one pipe so their order is
+ * kept.
+ */
+static void start_tee_log(const options_t *options)
+{
+	tee_log_t log = { .path = options->tee_log, .max_size = 0 };
+	tee_stream_t streams[2];
+	int fds[2][2], count = 1;
+	struct stat out_st, err_st;
+
+	if (options->tee_log_size != NULL) {
+		rlim_t size;
+
+		if (!parse_size(options->tee_log_size, &size))
+			die("Invalid log size: %s\n", options->tee_log_size);
+
+		log.max_size = size == RLIM_INFINITY || size > LLONG_MAX ? 0 : (off_t) size;
+	}
+
+	if ((log.fd = open_log(log.path, 0, &log.size)) == -1)
+		die("Failed to open %s: %s\n", log.path, strerror(errno));
+
+	if (fstat(STDOUT_FILENO, &out_st) != 0 || fstat(STDERR_FILENO, &err_st) != 0 ||
+			out_st.st_dev != err_st.st_dev || out_st.st_ino != err_st.st_ino)
+		count = 2;
+
+	for (int i = 0; i < count; ++i) {
+		make_pipe(fds[i]);
+		make_pipe(streams[i].copy);
+		streams[i].in = fds[i][0];
+		streams[i].out = STDOUT_FILENO + i;
+	}
+
+	pid_t pid = fork();
+
+	if (pid == -1)
+		die("Failed to fork: %s\n", strerror(errno));
+
+	if (pid == 0) {
+		if (fork() != 0)
+			_exit(0);
+
+		for (int i = 0; i < count; ++i)
+			close(fds[i][1]);
+
+		run_tee_log(streams, count, &log);
+	}
+
+	while (waitpid(pid, NULL, 0) == -1 && errno == EINTR)
+		;
+
+	for (int i = 0; i < count; ++i) {
+		close(streams[i].copy[0]);
+		close(streams[i].copy[1]);
+		close(fds[i][0]);
+	}
+
+	close(log.fd);
+
+	if (dup2(fds[0][1], STDOUT_FILENO) == -1 || dup2(fds[count - 1][1], STDERR_FILENO) == -1)
+		die("Failed to redirect output: %s\n", strerror(errno));
+
+	for (int i = 0; i < count; ++i)
+		close(fds[i][1]);
+}
+
+typedef struct audit_spec {
+	struct audit_spec *next;
+	char *spec;
+	long count;
+	rubyexec_status_t status[2];
+	const char *impl_name[2];
+} audit_spec_t;
+
+typedef struct {
+	char *path;
+	const audit_spec_t *spec;
+} audit_failure_t;
+
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	char **dirs;
+	size_t dir_count, dir_capacity;
+	int active;
+	audit_spec_t *specs;
+	audit_failure_t *failures;
+	size_t failure_count, failure_capacity;
+	long scripts;
+	const char *dir;
+	const char **broken;
+	rubyexec_default_t defaults[2];
+	int state_count;
+} audit_t;
+
+/*
+ * Returns the spec a script's shebang passes to rubyexec, or NULL if the
+ * script is not run by rubyexec.  Multi-call names are recognized by their
+ * ruby- prefix.
+ */
+static char *read_shebang_spec(const char *path)
+{
+	char buf[SHEBANG_SIZE + 1];
+	int fd = open(path, O_RDONLY | O_CLOEXEC | O_NOCTTY | O_NONBLOCK);
+
+	if (fd == -1)
+		return NULL;
+
+	ssize_t size = read(fd, buf, SHEBANG_SIZE);
+	close(fd);
+
+	if (size < 3 || buf[0] != '#' || buf[1] != '!')
+		return NULL;
+
+	buf[size] = '\0';
+
+	if (strchr(buf, '\n') == NULL)
+		return NULL;
+
+	buf[strcspn(buf, "\r\n")] = '\0';
+	char *interpreter = buf + 2 + strspn(buf + 2, " \t");
+	char *arg = interpreter + strcspn(interpreter, " \t");
+
+	if (*arg != '\0') {
+		*arg++ = '\0';
+		arg += strspn(arg, " \t");
+
+		for (char *end = arg + strlen(arg); end > arg && (end[-1] == ' ' || end[-1] == '\t');)
+			*--end = '\0';
+	}
+
+	const char *name = strrchr(interpreter, '/');
+	name = name == NULL ? interpreter : name + 1;
+
+	if (strcmp(name, "rubyexec") == 0)
+		return *arg == '\0' ? NULL : strdup(arg);
+
+	return strncmp(name, "ruby-", 5) == 0 ? get_multi_call_spec(interpreter) : NULL;
+}
+
+static void resolve_audit_spec(const audit_t *audit, audit_spec_t *entry)
+{
+	size_t size = strlen(entry->spec) + 1;
+	char *buf = do_malloc(size), impl_path[RUBYEXEC_PATH_SIZE];
+	rubyexec_spec_t spec;
+
+	for (int i = 0; i < audit->state_count; ++i) {
+		entry->impl_name[i] = NULL;
+
+		entry->status[i] = rubyexec_parse_spec(entry->spec, buf, size, &spec);
+
+		if (entry->status[i] == RUBYEXEC_OK) {
+			options_t options = { .spec_options = spec.options };
+			load_options(&options, NULL);
+			spec.autopick = options.autopick;
+			rubyexec_default_t def = audit->defaults[i];
+
+			if (i == 0)
+				apply_alternatives(&spec, audit->broken, &def);
+
+			entry->status[i] = rubyexec_select(&spec, audit->dir, &def, audit->broken,
+					impl_path, sizeof(impl_path), &entry->impl_name[i]);
+		}
+	}
+
+	free(buf);
+}
+
+static void audit_file(audit_t *audit, char *path)
+{
+	char *spec = read_shebang_spec(path);
+
+	if (spec == NULL) {
+		free(path);
+		return;
+	}
+
+	pthread_mutex_lock(&audit->lock);
+	audit_spec_t *entry = audit->specs;
+
+	while (entry != NULL && strcmp(entry->spec, spec) != 0)
+		entry = entry->next;
+
+	if (entry == NULL) {
+		entry = do_malloc(sizeof(*entry));
+		entry->spec = spec;
+		entry->count = 0;
+		entry->next = audit->specs;
+		audit->specs = entry;
+		resolve_audit_spec(audit, entry);
+	} else {
+		free(spec);
+	}
+
+	++entry->count;
+	++audit->scripts;
+
+	if (entry->status[audit->state_count - 1] != RUBYEXEC_OK) {
+		if (audit->failure_count == audit->failure_capacity)
+			audit->failures = do_realloc(audit->failures,
+					(audit->failure_capacity = audit->failure_capacity * 2 + 64) *
+					sizeof(*audit->failures));
+
+		audit->failures[audit->failure_count++] = (audit_failure_t) { path, entry };
+		path = NULL;
+	}
+
+	pthread_mutex_unlock(&audit->lock);
+	free(path);
+}
+
+static void push_audit_dir(audit_t *audit, char *dir)
+{
+	if (audit->dir_count == audit->dir_capacity)
+		audit->dirs = do_realloc(audit->dirs,
+				(audit->dir_capacity = audit->dir_capacity * 2 + 64) * sizeof(*audit->dirs));
+
+	audit->dirs[audit->dir_count++] = dir;
+}
+
+static void audit_directory(audit_t *audit, const char *path)
+{
+	DIR *dir = opendir(path);
+
+	if (dir == NULL)
+		return;
+
+	struct dirent *entry;
+	char **subdirs = NULL;
+	size_t count = 0, capacity = 0;
+
+	while ((entry = readdir(dir)) != NULL) {
+		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+			continue;
+
+		unsigned char type = entry->d_type;
+		struct stat st;
+
+		if (type == DT_UNKNOWN &&
+				fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+			type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+
+		if (type == DT_DIR) {
+			if (count == capacity)
+				subdirs = do_realloc(subdirs, (capacity = capacity * 2 + 16) * sizeof(*subdirs));
+
+			subdirs[count++] = strconcat(path, "/", entry->d_name, NULL);
+		} else if (type == DT_REG) {
+			audit_file(audit, strconcat(path, "/", entry->d_name, NULL));
+		}
+	}
+
+	closedir(dir);
+
+	if (count > 0) {
+		pthread_mutex_lock(&audit->lock);
+
+		for (size_t i = 0; i < count; ++i)
+			push_audit_dir(audit, subdirs[i]);
+
+		pthread_cond_broadcast(&audit->cond);
+		pthread_mutex_unlock(&audit->lock);
+	}
+
+	free(subdirs);
+}
+
+/*
+ * Workers share one stack of directories still to be read.  Each directory
+ * is read in one go by whichever worker takes it, and its subdirectories
+ * are pushed back for any idle worker to take.  The walk ends when the stack
+ * is empty and no worker is still reading.
+ */
+static void *audit_worker(void *arg)
+{
+	audit_t *audit = arg;
+	pthread_mutex_lock(&audit->lock);
+
+	for (;;) {
+		while (audit->dir_count == 0 && audit->active > 0)
+			pthread_cond_wait(&audit->cond, &audit->lock);
+
+		if (audit->dir_count == 0)
+			break;
+
+		char *dir = audit->dirs[--audit->dir_count];
+		++audit->active;
+		pthread_mutex_unlock(&audit->lock);
+		audit_directory(audit, dir);
+		free(dir);
+		pthread_mutex_lock(&audit->lock);
+
+		if (--audit->active == 0 && audit->dir_count == 0)
+			pthread_cond_broadcast(&audit->cond);
+	}
+
+	pthread_mutex_unlock(&audit->lock);
+	return NULL;
+}
+
+static int compare_audit_specs(const void *a, const void *b)
+{
+	const audit_spec_t *x = *(const audit_spec_t *const *) a;
+	const audit_spec_t *y = *(const audit_spec_t *const *) b;
+	return x->count != y->count ? (x->count < y->count ? 1 : -1) : strcmp(x->spec, y->spec);
+}
+
+static const char *describe_audit_result(const audit_spec_t *entry, int state)
+{
+	return entry->status[state] == RUBYEXEC_OK ? entry->impl_name[state] : "FAIL";
+}
+
+/*
+ * Implements --audit: finds every script under the given directories whose
+ * shebang runs rubyexec and reports how each distinct spec resolves now
+ * and, with --assume=IMPL, once the ruby symlink points to IMPL.  Scripts
+ * whose launch would fail are listed.
+ */
+static int audit_scripts(const char *dir, int argc, char **argv)
+{
+	audit_t audit = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER,
+			.dir = dir };
+	rubyexec_status_t status = rubyexec_read_default(dir, &audit.defaults[0]);
+	probe_t probe;
+	audit.state_count = 1;
+
+	if (status == RUBYEXEC_ERROR_SYSTEM)
+		die("Failed to resolve %s/ruby: %s\n", dir, strerror(errno));
+	else if (status != RUBYEXEC_OK)
+		die("%s\n", rubyexec_strerror(status));
+
+	if (audit.defaults[0].name == NULL &&
+			identify_implementation(audit.defaults[0].path, &probe)) {
+		audit.defaults[0].name = rubyexec_lookup_implementation(probe.impl);
+		audit.defaults[0].exact = true;
+	}
+
+	if (argc > 0 && strncmp(argv[0], "--assume=", 9) == 0) {
+		rubyexec_default_t *def = &audit.defaults[audit.state_count++];
+
+		if ((def->name = rubyexec_lookup_implementation(argv[0] + 9)) == NULL)
+			die("Unknown implementation: %s\n", argv[0] + 9);
+
+		snprintf(def->path, sizeof(def->path), "%s/%s", dir, def->name);
+		def->exact = false;
+
+		/* Assuming a missing target would report its specs as resolving */
+		if (access(def->path, X_OK) != 0)
+			die("Cannot assume %s: %s: %s\n", def->name, def->path, strerror(errno));
+		--argc;
+		++argv;
+	}
+
+	if (argc == 0)
+		die("No directories to audit.\n");
+
+	audit.broken = load_broken_implementations(true);
+
+	for (int i = argc; i-- > 0;)
+		push_audit_dir(&audit, strdup(argv[i]));
+
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int thread_count = cpus < 1 ? 1 : cpus > MAX_AUDIT_THREADS ? MAX_AUDIT_THREADS : (int) cpus;
+	pthread_t threads[MAX_AUDIT_THREADS];
+
+	for (int i = 0; i < thread_count; ++i)
+		if (pthread_create(&threads[i], NULL, audit_worker, &audit) != 0)
+			die("Failed to start audit thread: %s\n", strerror(errno));
+
+	for (int i = 0; i < thread_count; ++i)
+		pthread_join(threads[i], NULL);
+
+	size_t spec_count = 0;
+
+	for (audit_spec_t *entry = audit.specs; entry != NULL; entry = entry->next)
+		++spec_count;
+
+	audit_spec_t **specs = do_malloc((spec_count + 1) * sizeof(*specs));
+	spec_count = 0;
+
+	for (audit_spec_t *entry = audit.specs; entry != NULL; entry = entry->next)
+		specs[spec_count++] = entry;
+
+	qsort(specs, spec_count, sizeof(*specs), compare_audit_specs);
+	printf("%-40s %8s  %-10s%s\n", "SPEC", "SCRIPTS", "NOW",
+			audit.state_count > 1 ? "  ASSUMED" : "");
+
+	for (size_t i = 0; i < spec_count; ++i) {
+		printf("%-40s %8ld  %-10s", specs[i]->spec, specs[i]->count,
+				describe_audit_result(specs[i], 0));
+
+		if (audit.state_count > 1)
+			printf("  %s%s", describe_audit_result(specs[i], 1),
+					specs[i]->impl_name[0] != specs[i]->impl_name[1] ? " (changed)" : "");
+
+		putchar('\n');
+	}
+
+	printf("\n%ld scripts, %zu would fail%s.\n", audit.scripts, audit.failure_count,
+			audit.state_count > 1 ? " with the assumed ruby" : "");
+
+	for (size_t i = 0; i < audit.failure_count; ++i)
+		printf("%s: %s (%s)\n", audit.failures[i].path, audit.failures[i].spec->spec,
+				rubyexec_strerror(audit.failures[i].spec->status[audit.state_count - 1]));
+
+	return audit.failure_count == 0 ? 0 : 1;
+}
+
+static bool read_default(resolution_t *r, rubyexec_default_t *def)
+{
+	/*
+	 * ln -sf replaces a symlink by unlinking it first, so a missing one gets
+	 * a moment to return, doubling up to 32 ms in case the replacing process
+	 * was preempted on a busy machine.
+	 */
+	for (int i = 0; (r->status = rubyexec_read_default(r->dir, def)) != RUBYEXEC_OK; ++i) {
+		r->error = errno;
+
+		if (r->status != RUBYEXEC_ERROR_SYSTEM || r->error != ENOENT || i == RESOLVE_RETRIES)
+			return false;
+
+		nanosleep(&(struct timespec) { 0, RESOLVE_RETRY_DELAY_NS << i }, NULL);
+	}
+
+	return true;
+}
+
+static void select_implementation(resolution_t *r, rubyexec_default_t *def)
+{
+	probe_t probe;
+	apply_alternatives(r->spec, r->broken, def);
+
+	if (def->name == NULL && identify_implementation(def->path, &probe)) {
+		def->name = rubyexec_lookup_implementation(probe.impl);
+		def->exact = true;
+	}
+
+	r->status = rubyexec_select(r->spec, r->dir, def, r->broken, r->impl_path,
+			sizeof(r->impl_path), &r->impl_name);
+}
+
+static void resolve_implementation(resolution_t *r)
+{
+	rubyexec_default_t def;
+
+	if (read_default(r, &def))
+		select_implementation(r, &def);
+}
+
+static void copy_resolution(resolution_t *to, const resolution_t *from)
+{
+	to->status = from->status;
+	to->error = from->error;
+	memcpy(to->impl_path, from->impl_path, sizeof(to->impl_path));
+	to->impl_name = from->impl_name;
+}
+
+static void *resolution_thread(void *arg)
+{
+	resolution_t *r = arg;
+	resolve_implementation(r);
+	pthread_mutex_lock(&r->lock);
+	r->done = true;
+	pthread_cond_signal(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+	return NULL;
+}
+
+static bool read_last_good(const char *path, resolution_t *r)
+{
+	FILE *file = fopen(path, "re");
+	char line[RUBYEXEC_PATH_SIZE + 32], name[32];
+	int offset;
+	bool ok = false;
+
+	if (file == NULL)
+		return false;
+
+	if (fgets(line, sizeof(line), file) != NULL && (line[strcspn(line, "\n")] = '\0',
+			sscanf(line, "%31s %n", name, &offset) == 1) &&
+			(r->impl_name = rubyexec_lookup_implementation(name)) &&
+			copy_string(r->impl_path, sizeof(r->impl_path), line + offset) &&
+			!is_excluded(r->broken, r->impl_path))
+		ok = true;
+
+	fclose(file);
+	return ok;
+}
+
+static void write_last_good(const char *path, const resolution_t *r)
+{
+	resolution_t current = { .broken = NULL };
+	char data[RUBYEXEC_PATH_SIZE + 32];
+
+	if (r->status != RUBYEXEC_OK || (read_last_good(path, &current) &&
+			current.impl_name == r->impl_name && strcmp(current.impl_path, r->impl_path) == 0))
+		return;
+
+	int length = snprintf(data, sizeof(data), "%s %s\n", r->impl_name, r->impl_path);
+	write_file_atomically(path, data, length);
+}
+
+/* The overruns file is rotated to overruns.1 once it reaches MAX_OVERRUNS_SIZE. */
+static void record_overrun(const char *cache_dir, const char *spec_str, long elapsed_us)
+{
+	char *path = strconcat(cache_dir, "/overruns", NULL);
+	int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	char line[RUBYEXEC_PATH_SIZE + 64];
+	struct stat st;
+
+	if (fd != -1 && fstat(fd, &st) == 0 && st.st_size >= MAX_OVERRUNS_SIZE) {
+		char *old_path = strconcat(path, ".1", NULL);
+		close(fd);
+		rename(path, old_path);
+		fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+		free(old_path);
+	}
+
+	if (fd != -1) {
+		int length = snprintf(line, sizeof(line), "%lld %ld %s\n", (long long) time(NULL),
+				elapsed_us, spec_str);
+
+		ssize_t written = write(fd, line,
+				length < (int) sizeof(line) ? length : (int) sizeof(line) - 1);
+		(void) written;
+		close(fd);
+	}
+
+	free(path);
+}
+
+static char *get_last_good_path(const char *cache_dir, const char *dir, const char *spec_str)
+{
+	char *id = strconcat(dir, ":", spec_str, NULL), key[40];
+	snprintf(key, sizeof(key), "-%016llx", hash_string(id));
+	free(id);
+	return strconcat(cache_dir, "/resolved", key, NULL);
+}
+
+/*
+ * Resolves again in a detached rubyexec, run with the launch's arguments and
+ * RUBYEXEC_REVALIDATE set, which stores the result for later launches.  The
+ * stalled resolution thread may hold the malloc or stdio locks, so the
+ * children do nothing but async-signal-safe calls before execve().  The
+ * revalidating rubyexec inherits a lock on <good_path>.lock and holds it
+ * until it exits, so that a persistent stall leaves one of them blocked
+ * rather than one per launch.
+ */
+static void start_revalidation(const char *good_path, char **argv, char **original_environ)
+{
+	char *lock_path = strconcat(good_path, ".lock", NULL);
+	int lock_fd = open(lock_path, O_RDWR | O_CREAT, 0644);
+	size_t argc = 0, count = 0;
+
+	free(lock_path);
+
+	if (lock_fd == -1 || flock(lock_fd, LOCK_EX | LOCK_NB) != 0) {
+		if (lock_fd != -1)
+			close(lock_fd);
+
+		return;
+	}
+
+	while (argv[argc] != NULL)
+		++argc;
+
+	while (original_environ[count] != NULL)
+		++count;
+
+	char **new_argv = do_malloc((argc + 1) * sizeof(*new_argv));
+	char **envp = do_malloc((count + 2) * sizeof(*envp));
+	memcpy(new_argv, argv, (argc + 1) * sizeof(*new_argv));
+	memcpy(envp, original_environ, count * sizeof(*envp));
+	new_argv[0] = "rubyexec";
+	envp[count] = "RUBYEXEC_REVALIDATE=1";
+	envp[count + 1] = NULL;
+
+	pid_t pid = fork();
+
+	if (pid == 0) {
+		if (fork() != 0)
+			_exit(0);
+
+		int null_fd = open("/dev/null", O_RDWR | O_CLOEXEC);
+
+		for (int fd = 0; fd <= 2 && null_fd != -1; ++fd)
+			dup2(null_fd, fd);
+
+		execve("/proc/self/exe", new_argv, envp);
+		_exit(127);
+	}
+
+	close(lock_fd);
+
+	while (pid > 0 && waitpid(pid, NULL, 0) == -1 && errno == EINTR)
+		;
+
+	free(envp);
+	free(new_argv);
+}
+
+/* Implements RUBYEXEC_REVALIDATE: resolves without a budget and stores the result. */
+static int revalidate_last_good(resolution_t *r, const char *spec_str)
+{
+	char *cache_dir = get_cache_dir();
+
+	if (cache_dir == NULL)
+		return 1;
+
+	char *good_path = get_last_good_path(cache_dir, r->dir, spec_str);
+	resolve_implementation(r);
+	write_last_good(good_path, r);
+	free(good_path);
+	free(cache_dir);
+	return r->status == RUBYEXEC_OK ? 0 : 1;
+}
+
+/*
+ * Resolves in a separate thread and waits only until the launch budget runs
+ * out, since a stalled readlink() or access() on a network filesystem cannot
+ * be interrupted.  On an overrun, the last resolution that succeeded for the
+ * same spec is used instead, the overrun is appended to the overruns file in
+ * the cache directory, and a detached process refreshes the stored
+ * resolution.  Without a stored one, the launch waits.  The thread resolves
+ * into its own resolution_t, which is copied out only once it is done, since
+ * it may still be writing candidates when the budget runs out.
+ */
+static void govern_resolution(resolution_t *r, const char *budget_str, char **argv,
+		char **original_environ)
+{
+	const char *spec_str = argv[1];
+	long budget;
+
+	if (!parse_long(budget_str, 1, MAX_LAUNCH_BUDGET_US, &budget))
+		die("Invalid launch budget: %s\n", budget_str);
+
+	char *cache_dir = get_cache_dir();
+
+	if (cache_dir == NULL) {
+		resolve_implementation(r);
+		return;
+	}
+
+	char *good_path = get_last_good_path(cache_dir, r->dir, spec_str);
+	resolution_t *work = do_malloc(sizeof(*work));
+	struct timespec start, deadline, now;
+	pthread_condattr_t attr;
+	pthread_t thread;
+	bool threaded = true;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	deadline.tv_sec = start.tv_sec + (start.tv_nsec + budget * 1000) / 1000000000;
+	deadline.tv_nsec = (start.tv_nsec + budget * 1000) % 1000000000;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	*work = (resolution_t) { .spec = r->spec, .dir = r->dir, .broken = r->broken, .done = false };
+	pthread_cond_init(&work->cond, &attr);
+	pthread_mutex_init(&work->lock, NULL);
+
+	if (pthread_create(&thread, NULL, resolution_thread, work) != 0) {
+		resolve_implementation(work);
+		work->done = true;
+		threaded = false;
+	}
+
+	pthread_mutex_lock(&work->lock);
+
+	while (!work->done &&
+			pthread_cond_timedwait(&work->cond, &work->lock, &deadline) != ETIMEDOUT)
+		;
+
+	bool done = work->done;
+
+	if (done)
+		copy_resolution(r, work);
+
+	pthread_mutex_unlock(&work->lock);
+
+	if (done) {
+		write_last_good(good_path, r);
+	} else {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		record_overrun(cache_dir, spec_str, (now.tv_sec - start.tv_sec) * 1000000 +
+				(now.tv_nsec - start.tv_nsec) / 1000);
+		resolution_t last_good = { .broken = r->broken };
+
+		if (read_last_good(good_path, &last_good)) {
+			start_revalidation(good_path, argv, original_environ);
+			memcpy(r->impl_path, last_good.impl_path, sizeof(r->impl_path));
+			r->impl_name = last_good.impl_name;
+			r->status = RUBYEXEC_OK;
+		} else {
+			pthread_join(thread, NULL);
+			copy_resolution(r, work);
+			write_last_good(good_path, r);
+			done = true;
+			threaded = false;
+		}
+	}
+
+	/* A thread still stalled keeps its resolution_t until the launch execs. */
+	if (done) {
+		if (threaded)
+			pthread_join(thread, NULL);
+
+		free(work);
+	}
+
+	free(good_path);
+	free(cache_dir);
+}
+
+static void append_stat_time(char **buf, const char *path)
+{
+	struct stat st;
+	char str[48] = "-";
+
+	if (stat(path, &st) == 0)
+		snprintf(str, sizeof(str), "%lld.%ld", (long long) st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+
+	char *old = *buf;
+	*buf = strconcat(old, "\n", str, NULL);
+	free(old);
+}
+
+/*
+ * Fingerprints everything a resolution depends on: the spec and the options
+ * that can enable autopick, the interpreters known to be broken, the target
+ * of the ruby symlink and any alternatives link behind it, the directory
+ * holding the interpreters, whose mtime changes whenever one is added or
+ * removed, and the CPU level that build variants are chosen by, since the
+ * cache directory may be shared between hosts.  The default's own mtime
+ * covers a copy installed as ruby being replaced in place.
+ */
+static unsigned long long get_resolution_fingerprint(const char *dir, const char *target,
+		const char *spec_str, const char *const *broken)
+{
+	char second[RUBYEXEC_PATH_SIZE] = "", level[16];
+	ssize_t size;
+	const char *options = getenv("RUBYEXEC_OPTIONS");
+	snprintf(level, sizeof(level), "%d", get_x86_64_level());
+	char *buf = strconcat(spec_str, "\n", options == NULL ? "" : options, "\n", NULL);
+
+	for (const char *const *p = broken; *p != NULL; ++p) {
+		char *old = buf;
+		buf = strconcat(old, *p, ":", NULL);
+		free(old);
+	}
+
+	if (strncmp(target, ALTERNATIVES_LINK_DIR, strlen(ALTERNATIVES_LINK_DIR)) == 0) {
+		size = readlink(target, second, sizeof(second) - 1);
+		second[size > 0 ? size : 0] = '\0';
+		append_stat_time(&buf, ALTERNATIVES_LINK_DIR);
+	}
+
+	char *old = buf;
+	buf = strconcat(old, "\n", target, "\n", second, "\n", level, NULL);
+	free(old);
+	append_stat_time(&buf, target);
+	append_stat_time(&buf, dir);
+
+	unsigned long long fingerprint = hash_string(buf);
+
+	if (config != NULL)
+		for (size_t i = 0; i < sizeof(config->mtimes) / sizeof(**config->mtimes); ++i)
+			fingerprint = (fingerprint ^ (unsigned long long) config->mtimes[i / 2][i % 2]) *
+					1099511628211ULL;
+
+	free(buf);
+	return fingerprint;
+}
+
+/*
+ * Looks up the launch plan of a script, keyed by its device and inode and
+ * valid for its current mtime and the current inputs of the resolution.
+ * Checking a plan costs about as much as resolving from a ruby symlink that
+ * names its implementation, so plans are used only when the default has to
+ * be probed or found through alternatives.  plan->path is left NULL when
+ * plans are not used.
+ */
+static bool load_launch_plan(const char *script, const rubyexec_default_t *def,
+		const char *spec_str, const char *const *broken, launch_plan_t *plan, resolution_t *r)
+{
+	char *cache_dir, name[64], line[RUBYEXEC_PATH_SIZE + 96], impl_name[32];
+	long long sec, nsec;
+	unsigned long long fingerprint;
+	int offset;
+	bool ok = false;
+
+	plan->path = NULL;
+
+	if (def->name != NULL || script == NULL || stat(script, &plan->script_st) != 0 ||
+			(cache_dir = get_cache_dir()) == NULL)
+		return false;
+
+	snprintf(name, sizeof(name), "/plan-%llx-%llx", (unsigned long long) plan->script_st.st_dev,
+			(unsigned long long) plan->script_st.st_ino);
+	plan->path = strconcat(cache_dir, name, NULL);
+	plan->fingerprint = get_resolution_fingerprint(r->dir, def->path, spec_str, broken);
+	free(cache_dir);
+
+	FILE *file = fopen(plan->path, "re");
+
+	if (file == NULL)
+		return false;
+
+	if (fgets(line, sizeof(line), file) != NULL && (line[strcspn(line, "\n")] = '\0',
+			sscanf(line, "%lld %lld %llx %31s %n", &sec, &nsec, &fingerprint,
+				impl_name, &offset) == 4) &&
+			sec == plan->script_st.st_mtim.tv_sec && nsec == plan->script_st.st_mtim.tv_nsec &&
+			fingerprint == plan->fingerprint &&
+			(r->impl_name = rubyexec_lookup_implementation(impl_name)) &&
+			copy_string(r->impl_path, sizeof(r->impl_path), line + offset)) {
+		r->status = RUBYEXEC_OK;
+		ok = true;
+	}
+
+	fclose(file);
+	return ok;
+}
+
+static void save_launch_plan(const launch_plan_t *plan, const resolution_t *r)
+{
+	char data[RUBYEXEC_PATH_SIZE + 96];
+
+	if (plan->path == NULL || r->status != RUBYEXEC_OK)
+		return;
+
+	int length = snprintf(data, sizeof(data), "%lld %ld %llx %s %s\n",
+			(long long) plan->script_st.st_mtim.tv_sec, plan->script_st.st_mtim.tv_nsec,
+			plan->fingerprint, r->impl_name, r->impl_path);
+
+	if (length < (int) sizeof(data))
+		write_file_atomically(plan->path, data, length);
+}
+
+static const char *get_snapshot_string(const snapshot_t *snapshot, uint32_t offset)
+{
+	return (const char *) snapshot + offset;
+}
+
+static size_t count_variants(void)
+{
+	return sizeof(VARIANT_SUFFIXES) / sizeof(*VARIANT_SUFFIXES) - 1;
+}
+
+static void align_buffer(buffer_t *buf, size_t alignment)
+{
+	static const char zeros[8];
+
+	if (buf->size % alignment != 0)
+		append_data(buf, zeros, alignment - buf->size % alignment);
+}
+
+/*
+ * Implements --freeze: records the ruby symlink, the active alternative and
+ * the others by priority, which implementations and build variants are
+ * installed, and the compiled configuration in a snapshot next to rubyexec.
+ */
+static int freeze_state(const char *dir)
+{
+	size_t count = count_implementations(), variant_count = count_variants();
+	rubyexec_spec_t no_spec = { .implementations = { NULL }, .autopick = false };
+	rubyexec_default_t def;
+	alternatives_t alts;
+	rubyexec_status_t status = rubyexec_read_default(dir, &def);
+	probe_t probe;
+
+	if (status == RUBYEXEC_ERROR_SYSTEM)
+		die("Failed to resolve %s/ruby: %s\n", dir, strerror(errno));
+	else if (status != RUBYEXEC_OK)
+		die("%s\n", rubyexec_strerror(status));
+
+	if (!load_alternatives(def.path, &alts))
+		alts.count = 0;
+
+	apply_alternatives(&no_spec, NULL, &def);
+
+	if (def.name == NULL && identify_implementation(def.path, &probe)) {
+		def.name = rubyexec_lookup_implementation(probe.impl);
+		def.exact = true;
+	}
+
+	snapshot_t header = { .magic = "RBXSNAP", .version = SNAPSHOT_VERSION,
+			.implementation_count = count, .variant_count = variant_count,
+			.table_id = IMPLEMENTATION_TABLE_ID,
+			.default_index = def.name == NULL ? -1 : find_implementation(def.name),
+			.default_exact = def.exact, .alternative_count = 0 };
+	buffer_t buf = { NULL, 0, 0 };
+	append_data(&buf, &header, sizeof(header));
+
+	for (size_t i = 0; i < count; ++i) {
+		char *path = strconcat(dir, "/", IMPLEMENTATIONS[i], NULL);
+		uint32_t installed = access(path, F_OK) == 0;
+
+		for (size_t j = 0; j < variant_count; ++j) {
+			char *variant = strconcat(path, ".", VARIANT_SUFFIXES[j], NULL);
+
+			if (access(variant, X_OK) == 0)
+				installed |= 1U << (j + 1);
+
+			free(variant);
+		}
+
+		append_data(&buf, &installed, sizeof(installed));
+		free(path);
+	}
+
+	uint32_t default_path = append_data(&buf, def.path, strlen(def.path) + 1);
+	frozen_alternative_t frozen[MAX_ALTERNATIVES];
+	int frozen_count = 0;
+
+	for (int i = 0; i < alts.count; ++i)
+		if (alts.items[i].name != NULL)
+			frozen[frozen_count++] = (frozen_alternative_t) {
+				find_implementation(alts.items[i].name),
+				append_data(&buf, alts.items[i].path, strlen(alts.items[i].path) + 1)
+			};
+
+	align_buffer(&buf, 8);
+	uint32_t alternatives = append_data(&buf, frozen, frozen_count * sizeof(*frozen));
+	char *paths[2];
+	int64_t mtimes[2][2];
+	get_config_paths(paths);
+	get_config_mtimes(paths, mtimes);
+	config_image_t *image = compile_config(paths, mtimes);
+	align_buffer(&buf, 8);
+	uint32_t config_offset = append_data(&buf, image, image->size);
+
+	snapshot_t *snapshot = (snapshot_t *) buf.data;
+	snapshot->size = buf.size;
+	snapshot->config = config_offset;
+	snapshot->default_path = default_path;
+	snapshot->alternative_count = frozen_count;
+	snapshot->alternatives = alternatives;
+
+	char *snapshot_path = strconcat(dir, "/" SNAPSHOT_NAME, NULL);
+
+	if (!write_file_atomically(snapshot_path, buf.data, buf.size))
+		die("Failed to write %s: %s\n", snapshot_path, strerror(errno));
+
+	printf("%s\n", snapshot_path);
+	return 0;
+}
+
+/*
+ * Maps the snapshot next to rubyexec, if there is one.  A single fstat()
+ * checks that it is a complete regular file that only its owner, root or the
+ * current user, can have written.
+ */
+static bool is_snapshot_string(const snapshot_t *s, uint32_t offset)
+{
+	return offset < s->size && memchr((const char *) s + offset, '\0', s->size - offset) != NULL;
+}
+
+/*
+ * Checks every offset and index resolve_from_snapshot() follows, so that a
+ * damaged snapshot is ignored instead of being read out of bounds.
+ */
+static bool is_valid_snapshot(const snapshot_t *s, size_t size)
+{
+	uint64_t alternatives_end = s->alternatives +
+			(uint64_t) s->alternative_count * sizeof(frozen_alternative_t);
+
+	if (memcmp(s->magic, "RBXSNAP", 8) != 0 || s->version != SNAPSHOT_VERSION ||
+			s->size != size || s->implementation_count != count_implementations() ||
+			s->table_id != IMPLEMENTATION_TABLE_ID || s->variant_count != count_variants() ||
+			sizeof(*s) + (uint64_t) s->implementation_count * sizeof(s->installed[0]) > size ||
+			s->default_index < -1 || s->default_index >= (int32_t) s->implementation_count ||
+			!is_snapshot_string(s, s->default_path) || s->alternatives % 8 != 0 ||
+			alternatives_end > size || s->config >= size || s->config % 8 != 0)
+		return false;
+
+	const frozen_alternative_t *alternatives =
+			(const frozen_alternative_t *) ((const char *) s + s->alternatives);
+
+	for (uint32_t i = 0; i < s->alternative_count; ++i) {
+		int32_t index = alternatives[i].index;
+
+		if (index < -1 || index >= (int32_t) s->implementation_count ||
+				!is_snapshot_string(s, alternatives[i].path))
+			return false;
+	}
+
+	const config_image_t *config = (const config_image_t *) ((const char *) s + s->config);
+	return is_current_config(config, size - s->config, config->mtimes);
+}
+
+static const snapshot_t *load_snapshot(const char *dir)
+{
+	char *path = strconcat(dir, "/" SNAPSHOT_NAME, NULL);
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	const snapshot_t *snapshot = NULL;
+	struct stat st;
+
+	free(path);
+
+	if (fd == -1)
+		return NULL;
+
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+			(st.st_uid == 0 || st.st_uid == geteuid()) &&
+			(st.st_mode & (S_IWGRP | S_IWOTH)) == 0 && (size_t) st.st_size > sizeof(snapshot_t)) {
+		void *image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+		if (image != MAP_FAILED && is_valid_snapshot(image, st.st_size))
+			snapshot = image;
+		else if (image != MAP_FAILED)
+			munmap(image, st.st_size);
+	}
+
+	close(fd);
+	return snapshot;
+}
+
+static bool pick_frozen(resolution_t *r, int index, const char *path, bool check_exclude)
+{
+	if (index < 0 || !in(r->spec->implementations, IMPLEMENTATIONS[index]) ||
+			(check_exclude && is_excluded(r->broken, path)) ||
+			!copy_string(r->impl_path, sizeof(r->impl_path), path))
+		return false;
+
+	r->impl_name = IMPLEMENTATIONS[index];
+	return true;
+}
+
+/* Does what resolve_implementation() does, but from the snapshot alone. */
+static void resolve_from_snapshot(const snapshot_t *snapshot, resolution_t *r)
+{
+	const char *default_path = get_snapshot_string(snapshot, snapshot->default_path);
+	const frozen_alternative_t *alternatives =
+			(const frozen_alternative_t *) ((const char *) snapshot + snapshot->alternatives);
+	bool exact = snapshot->default_exact;
+	int index = -1;
+
+	r->status = RUBYEXEC_OK;
+
+	if (!overrides_default(r->spec) &&
+			pick_frozen(r, snapshot->default_index, default_path, r->spec->autopick)) {
+		index = snapshot->default_index;
+	} else if (!r->spec->autopick && !overrides_default(r->spec)) {
+		r->status = RUBYEXEC_ERROR_NOT_WANTED;
+		return;
+	} else {
+		const char *candidates[RUBYEXEC_MAX_SPEC_ITEMS + 1];
+		exact = true;
+
+		uint32_t alternative_count = overrides_default(r->spec) ? 0 : snapshot->alternative_count;
+
+		for (uint32_t i = 0; i < alternative_count && index == -1; ++i)
+			if (pick_frozen(r, alternatives[i].index,
+					get_snapshot_string(snapshot, alternatives[i].path), true))
+				index = alternatives[i].index;
+
+		get_candidates(r->spec,
+				snapshot->default_index < 0 ? NULL : IMPLEMENTATIONS[snapshot->default_index],
+				candidates);
 
-	execv(impl_path, create_new_argv(argc, argv, impl_path));
-	die("%s failed to execute: %s\n", impl_path, strerror(errno));
+		for (const char **p = candidates; *p != NULL && index == -1; ++p) {
+			int i = find_implementation(*p);
+			char path[RUBYEXEC_PATH_SIZE];
+
+			if (i == snapshot->default_index && pick_frozen(r, i, default_path, true)) {
+				index = i;
+				exact = snapshot->default_exact;
+			} else if ((snapshot->installed[i] & 1) &&
+					join_path(path, sizeof(path), r->dir, *p) && pick_frozen(r, i, path, true)) {
+				index = i;
+				exact = false;
+			}
+		}
+
+		if (index == -1) {
+			r->status = RUBYEXEC_ERROR_NO_USABLE_IMPLEMENTATIONS;
+			return;
+		}
+	}
+
+	if (exact)
+		return;
+
+	int level = get_x86_64_level();
+	size_t length = strlen(r->impl_path);
+
+	for (size_t i = 0; VARIANT_SUFFIXES[i] != NULL; ++i) {
+		const char *suffix = VARIANT_SUFFIXES[i];
+
+		if (!(snapshot->installed[index] & (1U << (i + 1))) ||
+				(strncmp(suffix, "x86-64-v", 8) == 0 && suffix[8] - '0' > level) ||
+				length + 1 + strlen(suffix) >= sizeof(r->impl_path))
+			continue;
+
+		r->impl_path[length] = '.';
+		strcpy(r->impl_path + length + 1, suffix);
+
+		if (!is_excluded(r->broken, r->impl_path))
+			return;
+
+		r->impl_path[length] = '\0';
+	}
+}
+
+static void print_usage(const char *program)
+{
+	fprintf(stderr, "rubyexec: Usage: %s impl,...[,option,...] [args]\n"
+			"       %s --probe [interpreter...]\n"
+			"       %s --audit [--assume=IMPL] dir...\n"
+			"       %s --compile-config\n"
+			"       %s --freeze\n"
+			"       ruby-X.Y[+] | ruby-mri-latest | NAME [interpreter-flag] script [args]\n\n"
+			"Options:\n"
+			"  -a, --autopick      Pick the first installed implementation if needed\n"
+			"  fast-start          Pick the installed implementation that boots fastest,\n"
+			"                      e.g. mruby, even over the default\n"
+			"  in-order            Pick the first installed implementation as listed, even\n"
+			"                      over the default\n"
+			"  --gc-tune           Tune MRI's GC from previous runs of the script\n"
+			"  --thread-tune       Use M:N threads on ruby33+ if previous runs of the script\n"
+			"                      mostly waited in many threads\n"
+			"  --allocator=NAME    Use allocator profile jemalloc, mimalloc, tcmalloc, glibc\n"
+			"                      or none\n"
+			"  --cpus=LIST         Run on the CPUs in LIST, e.g. 0-3:8-11\n"
+			"  --numa=NODE         Bind memory and CPUs to NODE, or to the node with the\n"
+			"                      most free memory if NODE is least-loaded\n"
+			"  --nice=N            Set the nice value to N\n"
+			"  --sched=POLICY      Use scheduling policy batch, idle or other\n"
+			"  --ioprio=CLASS[:N]  Use I/O priority class rt, be, idle or none\n"
+			"  --timer-slack=NS    Set the timer slack to NS nanoseconds\n"
+			"  --thp=on|off        Allow or disable transparent huge pages\n"
+			"  --stack=SIZE        Set the stack size limit, e.g. 64M or unlimited\n"
+			"  --as=SIZE           Set the address space limit\n"
+			"  --data=SIZE         Set the data segment limit\n"
+			"  --cgroup=NAME       Run in cgroup NAME next to the current one, creating it\n"
+			"                      with the following settings on first use\n"
+			"  --cpu-weight=N      Set cpu.weight of a new cgroup\n"
+			"  --memory-high=SIZE  Set memory.high of a new cgroup\n"
+			"  --tee-log=PATH      Also write the script's stdout and stderr to PATH\n"
+			"  --tee-log-size=SIZE Rotate the log to PATH.1 once it would exceed SIZE\n"
+			"  --launch-budget=US  Use the last good resolution if resolving takes longer\n"
+			"                      than US microseconds\n\n"
+			"Options are also read from RUBYEXEC_OPTIONS and RUBYEXEC_OPTIONS_<IMPL>, and\n"
+			"from the options and options.IMPL settings of " SYSTEM_CONFIG_PATH " and\n"
+			"~/.config/rubyexec.conf, which are compiled into the cache directory when\n"
+			"they change.\n"
+			"--freeze records the installed implementations, the ruby symlink and the\n"
+			"configuration in " SNAPSHOT_NAME " next to rubyexec.  While it exists,\n"
+			"launches resolve from it alone and write nothing.\n"
+			"Installed under another NAME, rubyexec reads its spec from NAME.spec next to\n"
+			"it, or derives it from ruby-X.Y, ruby-X.Y+ or ruby-mri-latest.\n"
+			"RUBYEXEC_PERF=1 adds the flags that let perf symbolize Ruby and JIT frames:\n"
+			"--yjit-perf on ruby33+ with YJIT, and frame pointers and a perf map on JRuby.\n"
+			"With --autopick, interpreters that fail to execute are skipped for\n"
+			"RUBYEXEC_NEGATIVE_TTL seconds (default %d), as are build variants always.\n",
+			program, program, program, program, program, DEFAULT_NEGATIVE_TTL);
+}
+
+int main(int argc, char **argv)
+{
+	int script_index = 2;
+	char *multi_call_spec = get_multi_call_spec(argv[0]);
+
+	if (multi_call_spec != NULL) {
+		char **new_argv = do_malloc((argc + 2) * sizeof(*new_argv));
+		new_argv[0] = argv[0];
+		new_argv[1] = multi_call_spec;
+		memcpy(new_argv + 2, argv + 1, argc * sizeof(*argv));
+
+		/* A single shebang argument before the script is passed to the interpreter. */
+		if (argc > 2 && argv[1][0] == '-')
+			script_index = 3;
+
+		argv = new_argv;
+		++argc;
+	} else if (argc < 2) {
+		fprintf(stderr, "rubyexec: Invalid number of arguments.\n");
+		return 2;
+	} else if (strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0) {
+		print_usage(argv[0]);
+		return 2;
+	} else if (strcmp(argv[1], "--probe") == 0) {
+		return probe_implementations(dirname(resolve_path("/proc/self/exe")), argc - 2, argv + 2);
+	} else if (strcmp(argv[1], "--freeze") == 0) {
+		return freeze_state(dirname(resolve_path("/proc/self/exe")));
+	} else if (strcmp(argv[1], "--compile-config") == 0) {
+		return compile_config_command();
+	} else if (strcmp(argv[1], "--audit") == 0) {
+		load_config();
+		return audit_scripts(dirname(resolve_path("/proc/self/exe")), argc - 2, argv + 2);
+	}
+
+	bool teeing = getenv("RUBYEXEC_TEE_LOG_ACTIVE") != NULL;
+	bool revalidating = getenv("RUBYEXEC_REVALIDATE") != NULL;
+	unsetenv("RUBYEXEC_TEE_LOG_ACTIVE");
+	unsetenv("RUBYEXEC_REVALIDATE");
+	size_t environ_size = 0;
+
+	while (environ[environ_size] != NULL)
+		++environ_size;
+
+	char **original_environ = do_malloc((environ_size + 1) * sizeof(*original_environ));
+	memcpy(original_environ, environ, (environ_size + 1) * sizeof(*original_environ));
+	size_t spec_size = strlen(argv[1]) + 1;
+	rubyexec_spec_t spec;
+	rubyexec_status_t status = rubyexec_parse_spec(argv[1], do_malloc(spec_size), spec_size,
+			&spec);
+
+	if (status != RUBYEXEC_OK)
+		die("%s\n", rubyexec_strerror(status));
+
+	options_t options = { .spec_options = spec.options };
+	char *rubyexec_dir = dirname(resolve_path("/proc/self/exe"));
+	const snapshot_t *snapshot = load_snapshot(rubyexec_dir);
+
+	if (snapshot != NULL)
+		config = (const config_image_t *) ((const char *) snapshot + snapshot->config);
+	else
+		load_config();
+
+	load_options(&options, NULL);
+	spec.autopick = options.autopick;
+	const char **broken = load_broken_implementations(snapshot == NULL);
+	resolution_t resolution = { .spec = &spec, .dir = rubyexec_dir, .broken = broken };
+	rubyexec_default_t def;
+	launch_plan_t plan;
+
+	if (revalidating)
+		return revalidate_last_good(&resolution, argv[1]);
+
+	if (snapshot != NULL) {
+		resolve_from_snapshot(snapshot, &resolution);
+	} else if (options.launch_budget != NULL) {
+		/* Checking a plan makes the very calls that stall, so a budget goes without. */
+		govern_resolution(&resolution, options.launch_budget, argv, original_environ);
+	} else if (read_default(&resolution, &def) && !load_launch_plan(argc > script_index ?
+			argv[script_index] : NULL, &def, argv[1], broken, &plan, &resolution)) {
+		select_implementation(&resolution, &def);
+		save_launch_plan(&plan, &resolution);
+	}
+
+	if (resolution.status == RUBYEXEC_ERROR_SYSTEM)
+		die("Failed to resolve %s/ruby: %s\n", rubyexec_dir, strerror(resolution.error));
+	else if (resolution.status != RUBYEXEC_OK)
+		die("%s\n", rubyexec_strerror(resolution.status));
+
+	char *impl_path = resolution.impl_path;
+	const char *impl_name = resolution.impl_name;
+	load_options(&options, impl_name);
+	args_t extra_args = { .count = 0 };
+
+	if (options.allocator != NULL)
+		apply_allocator_profile(options.allocator, impl_path);
+
+	if (options.cpus != NULL || options.numa != NULL)
+		apply_placement(&options);
+
+	apply_scheduling(&options);
+	apply_memory_limits(&options);
+
+	if (options.cgroup != NULL)
+		apply_cgroup(&options);
+
+	if (options.gc_tune)
+		prepare_gc_tuning(impl_name, argc > script_index ? argv[script_index] : NULL,
+				&extra_args);
+
+	if (options.thread_tune)
+		prepare_thread_tuning(impl_name, argc > script_index ? argv[script_index] : NULL,
+				&extra_args);
+
+	prepare_perf_flags(impl_name, impl_path, snapshot == NULL, &extra_args);
+
+	if (options.tee_log != NULL && !teeing) {
+		start_tee_log(&options);
+		teeing = true;
+	}
+
+	char **new_argv = do_malloc((argc + extra_args.count) * sizeof(*new_argv));
+	rubyexec_build_argv(impl_path, extra_args.items, extra_args.count, argv + 2, argc - 2,
+			new_argv, argc + extra_args.count);
+	execv(impl_path, new_argv);
+	int error = errno;
+
+	/*
+	 * An interpreter that vanished was most likely being replaced while this
+	 * launch ran.  It gets a moment to return, then one fresh resolution in
+	 * case the ruby symlink was re-pointed.  One that the fresh resolution
+	 * still picks and that is still missing goes in the negative cache, so a
+	 * permanently dangling interpreter does not cost the wait on every launch.
+	 */
+	bool known_broken = is_excluded(broken, impl_path);
+
+	for (int i = 0; error == ENOENT && !known_broken && i < RESOLVE_RETRIES; ++i) {
+		nanosleep(&(struct timespec) { 0, RESOLVE_RETRY_DELAY_NS << i }, NULL);
+		execv(impl_path, new_argv);
+		error = errno;
+	}
+
+	if (error == ENOENT && !known_broken) {
+		resolution_t fresh = { .spec = &spec, .dir = rubyexec_dir, .broken = broken };
+
+		if (snapshot == NULL) {
+			resolve_implementation(&fresh);
+
+			if (fresh.status == RUBYEXEC_OK && strcmp(fresh.impl_path, impl_path) == 0 &&
+					access(impl_path, F_OK) != 0)
+				record_broken_implementation(impl_path);
+		}
+
+		retry_launch(argv, original_environ, broken, impl_path, teeing);
+	}
+
+	/* A variant built for the wrong CPU or libc is skipped even without autopick. */
+	if ((options.autopick || overrides_default(&spec) || is_variant(impl_path)) &&
+			(error == ENOEXEC || error == EACCES || error == ELIBBAD)) {
+		if (snapshot == NULL)
+			record_broken_implementation(impl_path);
+
+		retry_launch(argv, original_environ, broken, impl_path, teeing);
+	}
+
+	die("%s failed to execute: %s\n", impl_path, strerror(error));
 	return 1;
 }
+
+#endif
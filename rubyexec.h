@@ -0,0 +1,122 @@
+/*
+ * Copyright © 2024 konsolebox
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the “Software”), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * The implementation selection of rubyexec as a library, so that a process
+ * that launches many scripts can resolve their rubyexec shebangs itself and
+ * spawn the interpreter directly.  Build it from rubyexec.c with
+ * RUBYEXEC_LIBRARY defined, which leaves out main() and the launcher-only
+ * features:
+ *
+ *     cc -DRUBYEXEC_LIBRARY -fPIC -shared -o librubyexec.so rubyexec.c
+ *
+ * The known implementations come from implementations.list, compiled into
+ * implementations.h by gen-implementations.sh.
+ *
+ * No function allocates memory or keeps state between calls.
+ * rubyexec_read_default(), rubyexec_select() and
+ * rubyexec_has_launcher_settings() look at the file system, and the last
+ * also at the environment; the others work only on memory given by the
+ * caller.  Probing of unknown interpreters, the negative cache and all
+ * options other than --autopick remain the launcher's business.
+ */
+
+#ifndef RUBYEXEC_H
+#define RUBYEXEC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define RUBYEXEC_PATH_SIZE 1024
+#define RUBYEXEC_MAX_SPEC_ITEMS 64
+
+typedef enum {
+	RUBYEXEC_OK,
+	RUBYEXEC_ERROR_SYSTEM, /* errno tells the cause */
+	RUBYEXEC_ERROR_TOO_LONG,
+	RUBYEXEC_ERROR_NO_VALID_IMPLEMENTATIONS,
+	RUBYEXEC_ERROR_NOT_WANTED,
+	RUBYEXEC_ERROR_NO_USABLE_IMPLEMENTATIONS
+} rubyexec_status_t;
+
+typedef struct {
+	const char *implementations[RUBYEXEC_MAX_SPEC_ITEMS + 1];
+	const char *options[RUBYEXEC_MAX_SPEC_ITEMS + 1];
+	bool autopick;
+	bool fast_start; /* Prefer the installed implementation cheapest to boot */
+	bool in_order;   /* Prefer the first installed implementation as listed */
+} rubyexec_spec_t;
+
+/* The implementation the ruby symlink next to rubyexec currently selects */
+typedef struct {
+	char path[RUBYEXEC_PATH_SIZE];
+	const char *name; /* NULL if the target's name is not an implementation */
+	bool exact;       /* The target is a specific build variant */
+} rubyexec_default_t;
+
+/* Returns the registered name equal to name, or NULL. */
+const char *rubyexec_lookup_implementation(const char *name);
+
+/*
+ * Parses a spec like "ruby33,ruby32,-a".  The spec is copied into buf, which
+ * the pointers stored in spec refer to afterwards.
+ */
+rubyexec_status_t rubyexec_parse_spec(const char *str, char *buf, size_t size,
+		rubyexec_spec_t *spec);
+
+/* Reads the ruby symlink in dir, the directory of rubyexec and the interpreters. */
+rubyexec_status_t rubyexec_read_default(const char *dir, rubyexec_default_t *def);
+
+/*
+ * Chooses the interpreter for spec: the default if the spec accepts it,
+ * otherwise the first installed one with autopick, then its best build
+ * variant.  With fast-start in the spec, the installed implementation
+ * cheapest to boot is chosen even over the default, and with in-order, the
+ * first installed one as listed.  Paths listed in exclude, which may be
+ * NULL, are skipped when autopicking.
+ */
+rubyexec_status_t rubyexec_select(const rubyexec_spec_t *spec, const char *dir,
+		const rubyexec_default_t *def, const char *const *exclude, char *impl_path, size_t size,
+		const char **impl_name);
+
+/*
+ * Builds the interpreter's argv from impl_path, extra interpreter arguments
+ * and the script and its arguments.  new_argv needs room for
+ * extra_count + arg_count + 2 pointers.
+ */
+rubyexec_status_t rubyexec_build_argv(const char *impl_path, const char *const *extra_args,
+		int extra_count, char *const *args, int arg_count, char **new_argv, size_t size);
+
+/*
+ * Whether launches through rubyexec in dir depend on more than the spec: a
+ * snapshot made with --freeze, or options set by /etc/rubyexec.conf or the
+ * user's rubyexec.conf.  Only rubyexec itself can launch such scripts
+ * correctly.  The configuration is read from the image rubyexec compiles
+ * into its cache directory, never from the text; while that image is
+ * missing or older than the files, the answer is true.
+ */
+bool rubyexec_has_launcher_settings(const char *dir);
+
+const char *rubyexec_strerror(rubyexec_status_t status);
+
+#endif
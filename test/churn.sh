@@ -0,0 +1,151 @@
+#!/bin/sh
+
+# Stress test for launches racing interpreter replacement.  Launches run in
+# parallel while another process keeps re-pointing the ruby symlink between
+# two interpreters, replacing it with a plain copy that must be probed, and
+# removing and re-creating one of the interpreters, the way ln -sf and
+# package upgrades do.  Half the launches use --launch-budget, so the broken,
+# plan-*, probes and resolved-* files in the cache all get concurrent
+# writers.  Every launch must run one of the two interpreters or fail with a
+# clean message; spurious "No such file or directory" failures are counted.
+# The launch rate is reported with and without the churn, and finally one
+# interpreter is left dangling, which must be skipped through the negative
+# cache.
+#
+# A stub can also vanish after rubyexec executed it, between the kernel
+# reading its #! line and /bin/sh reopening it by name.  Real interpreters
+# have no such window, so these are reported as stub races, not failures.
+#
+# Usage: test/churn.sh [-n launches] [-j jobs] rubyexec
+#
+# rubyexec is a built binary.  The interpreters are /bin/sh stubs named
+# ruby32 and ruby33 that answer the probe and otherwise print their name,
+# so no Ruby needs to be installed.  Everything is done in a temporary
+# directory.
+
+set -e
+
+launches=4000
+jobs=8
+
+while [ $# -gt 1 ]; do
+	case $1 in
+	-n) launches=$2 ;;
+	-j) jobs=$2 ;;
+	*) break ;;
+	esac
+
+	shift 2
+done
+
+if [ $# -ne 1 ]; then
+	echo "Usage: $0 [-n launches] [-j jobs] rubyexec" >&2
+	exit 2
+fi
+
+a=ruby32
+b=ruby33
+work=$(mktemp -d)
+trap 'touch "$work/stop"; wait; rm -rf "$work"' EXIT INT TERM
+cp "$1" "$work/rubyexec"
+
+for impl in $a $b; do
+	version=3.${impl#ruby3}.0
+	printf '#!/bin/sh\nif [ "$1" = -e ]; then printf "ruby %s 0"; else printf %s; fi\n' \
+		"$version" "$impl" > "$work/stub-$impl"
+	chmod +x "$work/stub-$impl"
+	cp "$work/stub-$impl" "$work/$impl"
+done
+
+ln -s "$a" "$work/ruby"
+mkdir "$work/cache"
+export RUBYEXEC_CACHE_DIR="$work/cache"
+unset RUBYEXEC_OPTIONS RUBYEXEC_EXCLUDE
+
+printf '#!%s %s,%s,-a\n' "$work/rubyexec" "$a" "$b" > "$work/script-0"
+printf '#!%s %s,%s,-a,--launch-budget=1000000\n' "$work/rubyexec" "$a" "$b" > "$work/script-1"
+chmod +x "$work/script-0" "$work/script-1"
+
+now_ms() {
+	echo $(($(date +%s%N) / 1000000))
+}
+
+# Runs $launches launches split over $jobs workers, and prints the rate.
+run_launches() {
+	phase=$1 pids= start=$(now_ms) j=0
+
+	while [ $j -lt "$jobs" ]; do
+		(
+			k=$j
+
+			while [ $k -lt "$launches" ]; do
+				output=$("$work/script-$((k % 2))" 2> "$work/error-$j") || output=
+
+				if [ "$output" = "$a" ] || [ "$output" = "$b" ]; then
+					echo ok
+				elif grep -q '^rubyexec: .*No such file or directory' "$work/error-$j"; then
+					echo missing
+				elif grep -q "^/bin/sh: .*cannot open $work/" "$work/error-$j"; then
+					echo stub
+				else
+					echo other
+					sed 's/^/  /' "$work/error-$j" >&2
+				fi
+
+				k=$((k + jobs))
+			done > "$work/$phase-$j"
+		) &
+
+		pids="$pids $!"
+		j=$((j + 1))
+	done
+
+	wait $pids
+	elapsed=$(($(now_ms) - start))
+	cat "$work/$phase"-* > "$work/$phase"
+	ok=$(grep -c '^ok$' "$work/$phase" || true)
+	missing=$(grep -c '^missing$' "$work/$phase" || true)
+	stub=$(grep -c '^stub$' "$work/$phase" || true)
+	other=$(grep -c '^other$' "$work/$phase" || true)
+	echo "$phase: $launches launches, $ok ok, $missing missing interpreter," \
+		"$stub stub races, $other other failures," \
+		"$((launches * 1000 / (elapsed + 1))) launches/s"
+}
+
+run_launches quiet
+quiet_failures=$((missing + other))
+
+(
+	# Removed first, as ln -sf and most package managers do
+	while [ ! -e "$work/stop" ]; do
+		rm -f "$work/ruby"
+		ln -s "$b" "$work/ruby"
+		rm -f "$work/$a"
+		cp "$work/stub-$a" "$work/$a.new"
+		mv "$work/$a.new" "$work/$a"
+		cp "$work/stub-$a" "$work/ruby.new"
+		mv "$work/ruby.new" "$work/ruby"
+		rm -f "$work/ruby"
+		ln -s "$a" "$work/ruby"
+	done
+) &
+churn=$!
+
+run_launches churn
+touch "$work/stop"
+wait $churn
+rm -f "$work/stop"
+
+# A permanently dangling interpreter is skipped, and remembered as broken.
+rm -f "$work/$a" "$work/cache/broken"
+ln -s "$work/nonexistent" "$work/$a"
+dangling=ok
+
+for i in 1 2; do
+	[ "$("$work/script-0")" = "$b" ] || dangling=failed
+done
+
+grep -q " $work/$a\$" "$work/cache/broken" 2> /dev/null || dangling=failed
+echo "dangling: $dangling"
+
+[ $quiet_failures -eq 0 ] && [ $missing -eq 0 ] && [ $other -eq 0 ] && [ $dangling = ok ]